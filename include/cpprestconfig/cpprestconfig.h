@@ -2,10 +2,26 @@
 #ifndef INCLUDE_CPPRESTCONFIG_CPPRESTCONFIG_H_
 #define INCLUDE_CPPRESTCONFIG_CPPRESTCONFIG_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
 #include <functional>
+#include <future>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 namespace cpprestconfig {
 
+#ifdef CPPRESTCONFIG_INSTRUMENT
+// Counts a read of the key with the given id, see GET <base>/_stats. Only
+// built with -DCPPRESTCONFIG_INSTRUMENT=ON; otherwise reads cost nothing
+// extra.
+void count_read(size_t id);
+#endif
+
 template<typename T>
 struct limits;
 
@@ -21,16 +37,212 @@ struct limits<int> {
     int step;
 };
 
+template<>
+struct limits<int64_t> {
+    int64_t min;
+    int64_t max;
+    int64_t step;
+};
+
+// Constraints only apply if min < max. A step of 0 allows any value in
+// between.
+template<>
+struct limits<double> {
+    double min;
+    double max;
+    double step;
+};
+
+template<>
+struct limits<std::string> {
+    // reserved
+};
+
+// Percentage of ids, e.g., of users or requests, for which a code path is
+// enabled, so that it can be ramped up gradually. See handle<rollout>.
+struct rollout {
+    double percent;
+};
+
+// Values are kept between 0 and 100 in any case; constraints as for double.
+template<>
+struct limits<rollout> {
+    double min;
+    double max;
+    double step;
+};
+
 enum Options {
     Default = 0,
     NoPersist = (1 << 0),
+    // Call the callback from a dedicated thread instead of the one changing
+    // the value. Changes made while a callback is queued are coalesced into
+    // a single call with the latest value.
+    AsyncCallback = (1 << 1),
 };
 
+inline Options operator|(Options a, Options b) {
+    return static_cast<Options>(static_cast<int>(a) | static_cast<int>(b));
+}
+
 template<typename T>
 using callback = std::function<void(const char *key, T value)>;
 
+constexpr uint64_t key_hash_step(const char *key, uint64_t h) {
+    return *key ?
+        key_hash_step(key + 1, (h ^ static_cast<unsigned char>(*key)) *
+            1099511628211ULL) :
+        h;
+}
+
+// FNV-1a hash of a key, as used to index the registry. Being constexpr, it
+// hashes string literals at compile time.
+constexpr uint64_t key_hash(const char *key) {
+    return key_hash_step(key, 14695981039346656037ULL);
+}
+
+// Scrambles ids, e.g., sequential ones, into evenly spread buckets, as the
+// finalizer of SplitMix64 does.
+inline uint64_t rollout_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Read handle to a configuration variable. get() is race-free with respect
+// to updates coming from the REST interface and compiles to a plain load on
+// x86. For compatibility, a handle also converts to a T& aliasing the same
+// storage, so that `const bool &x = config(...)` keeps working; reads
+// through such a reference are not synchronized with updates.
+template<typename T>
+class handle {
+    static_assert(sizeof(std::atomic<T>) == sizeof(T),
+        "std::atomic<T> must have the same representation as T");
+
+ public:
+    handle() : _value(NULL), _id(0) {}
+    handle(std::atomic<T> *value, size_t id) : _value(value), _id(id) {}
+
+    T get() const {
+#ifdef CPPRESTCONFIG_INSTRUMENT
+        count_read(_id);
+#endif
+        return _value->load(std::memory_order_relaxed);
+    }
+
+    operator T&() const {
+        return *reinterpret_cast<T *>(_value);
+    }
+
+    size_t id() const {
+        return _id;
+    }
+
+ private:
+    std::atomic<T> *_value;
+    size_t _id;
+};
+
+// Strings are replaced as a whole, so get() returns a copy of the current
+// value. It is lock-free, but not as cheap as reading other types.
+template<>
+class handle<std::string> {
+ public:
+    handle() : _value(NULL), _id(0) {}
+    handle(std::atomic<const std::string *> *value, size_t id)
+        : _value(value), _id(id) {}
+
+    std::string get() const;
+
+    size_t id() const {
+        return _id;
+    }
+
+ private:
+    std::atomic<const std::string *> *_value;
+    size_t _id;
+};
+
+// Decides whether a code path is enabled for an id by hashing the id into
+// one of 2^53 buckets in [0, 100), and comparing it to the percentage.
+// Hence, an id stays enabled as the percentage grows. Ids are hashed with
+// the key, so that different rollouts enable different ids.
+template<>
+class handle<rollout> {
+ public:
+    handle() : _value(NULL), _id(0), _salt(0) {}
+    handle(std::atomic<double> *value, size_t id, uint64_t salt)
+        : _value(value), _id(id), _salt(salt) {}
+
+    rollout get() const {
+#ifdef CPPRESTCONFIG_INSTRUMENT
+        count_read(_id);
+#endif
+        return rollout{_value->load(std::memory_order_relaxed)};
+    }
+
+    // Does not lock nor allocate.
+    bool enabled_for(uint64_t id) const {
+#ifdef CPPRESTCONFIG_INSTRUMENT
+        count_read(_id);
+#endif
+        double bucket = static_cast<double>(rollout_mix(id ^ _salt) >> 11) *
+            (100.0 / 9007199254740992.0);  // i.e., 100 / 2^53
+        return bucket < _value->load(std::memory_order_relaxed);
+    }
+
+    size_t id() const {
+        return _id;
+    }
+
+ private:
+    std::atomic<double> *_value;
+    size_t _id;
+    uint64_t _salt;
+};
+
+struct SnapshotData;
+
+// Immutable view of all values, as published by the latest change. Values
+// read from the same Snapshot are consistent with each other, even while
+// other threads change several keys at once. A Snapshot must be destroyed
+// by the thread that took it, and should be short-lived, since it delays
+// reclaiming older snapshots.
+class Snapshot {
+ public:
+    Snapshot(Snapshot &&other);
+    ~Snapshot();
+
+    uint64_t generation() const;
+
+    bool get(const handle<bool> &h) const;
+    int get(const handle<int> &h) const;
+    int64_t get(const handle<int64_t> &h) const;
+    double get(const handle<double> &h) const;
+    std::string get(const handle<std::string> &h) const;
+
+    template<typename E>
+    E get(const handle<E> &h) const {
+        static_assert(std::is_enum<E>::value, "unsupported type");
+        return static_cast<E>(get_enum(h.id(), static_cast<int>(h.get())));
+    }
+
+ private:
+    int get_enum(size_t id, int live) const;
+
+    friend Snapshot snapshot();
+    explicit Snapshot(const SnapshotData *data);
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+
+    const SnapshotData *_data;
+    bool _reading;
+};
+
+Snapshot snapshot();
+
 template<typename T>
-T &config(
+handle<T> config(
     T default_value,
     const char *key,
     const char *short_desc,
@@ -39,13 +251,228 @@ T &config(
     limits<T> limits = {},
     Options options = Default);
 
+// Names of the values of an enum, as set and shown over REST.
+template<typename E>
+using enum_names = std::vector<std::pair<const char *, E>>;
+
+handle<int> config_enum(
+    int default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    const enum_names<int> &names,
+    callback<int> callback,
+    Options options);
+
+// Enums must have the size of an int, and be given a name for each value.
+template<typename E,
+    typename = typename std::enable_if<std::is_enum<E>::value>::type>
+handle<E> config(
+    E default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    const enum_names<E> &names,
+    callback<E> callback = {},
+    Options options = Default
+) {
+    static_assert(sizeof(E) == sizeof(int),
+        "E must have the size of an int");
+
+    enum_names<int> int_names;
+    for (auto const &name : names)
+        int_names.push_back(std::make_pair(name.first, static_cast<int>(
+            name.second)));
+
+    cpprestconfig::callback<int> int_callback;
+    if (callback) {
+        int_callback = [callback](const char *key, int value) {
+            callback(key, static_cast<E>(value));
+        };
+    }
+
+    handle<int> h = config_enum(static_cast<int>(default_value), key,
+        short_desc, long_desc, int_names, int_callback, options);
+    int &storage = h;  // i.e., the representation of the std::atomic<int>
+    return handle<E>(reinterpret_cast<std::atomic<E> *>(&storage), h.id());
+}
+
+// Metadata of a key declared with CPPRESTCONFIG_DEFINE. Being constexpr, it
+// is laid out at compile time, hash of the key included.
+template<typename T>
+struct definition {
+    T default_value;
+    const char *key;
+    uint64_t key_hash;
+    const char *short_desc;
+    const char *long_desc;
+    cpprestconfig::limits<T> limits;
+    Options options;
+};
+
+class DefinitionImporter;
+
+// A key declared with CPPRESTCONFIG_DEFINE. It holds its own value, so that
+// it is constant-initialized and can be read from any static initializer.
+// Declared keys are only linked into a list at startup; the registry imports
+// them when first used.
+class defined_base {
+ public:
+    // Links this into the keys to import, without allocating.
+    void enlist();
+
+ protected:
+    static constexpr size_t kNotImported = static_cast<size_t>(-1);
+
+    constexpr defined_base() : _id(kNotImported), _next(NULL) {}
+
+    // Imports pending keys, if needed.
+    size_t id() const;
+
+    std::atomic<size_t> _id;  // set by import()
+
+ private:
+    friend class DefinitionImporter;
+
+    // Called with the registry locked. Returns whether a persisted value
+    // was loaded.
+    virtual bool import() = 0;
+
+    defined_base *_next;
+};
+
+// Supports bool, int, int64_t and double.
+template<typename T>
+class defined : public defined_base {
+ public:
+    constexpr explicit defined(const definition<T> *d)
+        : _definition(d), _value(d->default_value) {
+    }
+
+    T get() const {
+#ifdef CPPRESTCONFIG_INSTRUMENT
+        // reads before the key is imported are not counted
+        size_t id = _id.load(std::memory_order_relaxed);
+        if (id != kNotImported)
+            count_read(id);
+#endif
+        return _value.load(std::memory_order_relaxed);
+    }
+
+    // E.g., to read it from a Snapshot
+    operator handle<T>() const {
+        return handle<T>(const_cast<std::atomic<T> *>(&_value), id());
+    }
+
+ private:
+    bool import() override;
+
+    const definition<T> *_definition;
+    std::atomic<T> _value;
+};
+
+// Declares a configuration variable at namespace scope, without allocating
+// nor locking during static initialization, e.g.:
+//
+//   CPPRESTCONFIG_DEFINE(int, verbosity, 0, "main.verbosity",
+//       "How much to log", "Longer description", {0, 3, 1});
+//
+// declares `cpprestconfig::defined<int> verbosity`. Arguments after the
+// long description are the limits and options.
+#define CPPRESTCONFIG_DEFINE(type, name, default_value, key, ...) \
+    constexpr ::cpprestconfig::definition<type> name##_definition = { \
+        default_value, key, ::cpprestconfig::key_hash(key), __VA_ARGS__}; \
+    ::cpprestconfig::defined<type> name(&name##_definition); \
+    static const bool name##_enlisted = (name.enlist(), true)
+
+enum ServerOptions {
+    ServerDefault = 0,
+    // Persist to a memory-mapped file indexed by key hash instead of a
+    // journal, which speeds up starting with many keys. Values longer than
+    // about 100 bytes cannot be persisted this way, and are rejected.
+    PersistMmap = (1 << 0),
+    // Reload the value of a key as soon as another tool writes it into a
+    // file named as the key in persistDir, e.g., configuration management.
+    WatchPersistDir = (1 << 1),
+};
+
+inline ServerOptions operator|(ServerOptions a, ServerOptions b) {
+    return static_cast<ServerOptions>(
+        static_cast<int>(a) | static_cast<int>(b));
+}
+
 void start_server(
     int port = 8080,
     const char *baseurl = "/api/config",
-    const char *persistDir = NULL);
+    const char *persistDir = NULL,
+    ServerOptions server_options = ServerDefault);
 
+// Same as start_server(), but loads persisted values and binds the port
+// from a thread of its own, so that starting the application does not wait
+// for them. Meanwhile, values read through handles and references are the
+// defaults, or as loaded so far. The future becomes ready once requests
+// are served, or throws if the server cannot be started. Wait for it
+// before calling stop_server().
+std::future<void> start_server_async(
+    int port = 8080,
+    const char *baseurl = "/api/config",
+    const char *persistDir = NULL,
+    ServerOptions server_options = ServerDefault);
+
+// Stops serving requests, then waits for pending values to be persisted.
 void stop_server();
 
+// Also serves the same API, and metrics at /metrics, over HTTP/1.1 on the
+// Unix domain socket `path`, e.g., for local automation making many
+// changes. Only users allowed by the file `mode` may connect. Does not
+// need start_server().
+void start_unix_server(
+    const char *path,
+    const char *baseurl = "/api/config",
+    int mode = 0600);
+void stop_unix_server();
+
+// For pre-fork servers, where only one process can serve REST: it shares
+// all values with the others through the POSIX shared memory segment
+// `name`, e.g., "/myapp-config". Keys longer than 120 bytes and values
+// longer than 256 bytes are not shared.
+void start_sharing(const char *name);
+
+// Removes the segment, so that followers started later do not see stale
+// values. Followers keep their values until a process shares again.
+void stop_sharing();
+
+// Makes this process follow the values shared by another one, from
+// a dedicated thread. Handles read them at memory speed and callbacks are
+// called as for changes over REST. The segment may be created later.
+void start_following(const char *name);
+void stop_following();
+
+// Values are persisted by a background thread, so that changing them does
+// not wait for the disk. Changes to the same key made within `milliseconds`
+// are written once. Applies to servers started afterwards; default is 100.
+void set_persist_interval(int milliseconds);
+
+// Blocks until all changes made so far are durably persisted, and their
+// asynchronous callbacks have returned.
+void flush();
+
+// Asynchronous callbacks are queued once per key. If `max_queued` keys are
+// queued already, changing a further key waits until one of them has been
+// called, so that the callbacks of a key never overlap. Default is 1024.
+void set_callback_queue_limit(size_t max_queued);
+
+// Counters of asynchronous callbacks since the process started.
+struct CallbackMetrics {
+    uint64_t queued;  // queued for a key without one queued yet
+    uint64_t coalesced;  // replaced the one already queued for the key
+    uint64_t overflowed;  // waited for room, the queue being full
+    uint64_t dispatched;  // called from the dedicated thread
+    uint64_t pending;  // queued or running
+};
+
+CallbackMetrics callback_metrics();
+
 }  // namespace cpprestconfig
 
 #endif  // INCLUDE_CPPRESTCONFIG_CPPRESTCONFIG_H_
@@ -25,10 +25,17 @@ int main(int argc, char **argv) {
         "Usage:\n"
         "* List all configuration variables:\n"
         "  curl http://localhost:8089/api/config | jq .\n"
+        "* Show only the values of variables starting with 'main.':\n"
+        "  curl 'http://localhost:8089/api/config?prefix=main.&fields=value'\n"
+        "* Show one configuration variable:\n"
+        "  curl http://localhost:8089/api/config/main.print_red\n"
         "* Print green every second:\n"
         "  curl -XPUT http://localhost:8089/api/config/main.print_green -d true\n"
         "* Do not print red every second:\n"
         "  curl -XPUT http://localhost:8089/api/config/main.print_red -d false\n"
+        "* Swap colors in a single change:\n"
+        "  curl -XPOST http://localhost:8089/api/config"
+        " -d '{\"main.print_red\": false, \"main.print_green\": true}'\n"
     );
 
     while (true) {
@@ -0,0 +1,110 @@
+// Copyright 2019 Cristian Klein
+#include "src/callback_executor.h"
+
+#include <exception>
+#include <utility>
+
+#include "spdlog/spdlog.h"
+#include "src/logger.h"
+
+namespace cpprestconfig {
+
+CallbackExecutor::CallbackExecutor(size_t max_queued)
+    : _max_queued(max_queued),
+      _posted_seq(0),
+      _done_seq(0),
+      _metrics(),
+      _running(false),
+      _stopping(false) {
+    _thread = std::thread(&CallbackExecutor::run, this);
+}
+
+CallbackExecutor::~CallbackExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wakeup.notify_one();
+    _thread.join();
+}
+
+void CallbackExecutor::post(const void *key, std::function<void()> fn) {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _queued.find(key);
+        if (it == _queued.end() && !_queued.empty() &&
+                _queued.size() >= _max_queued &&
+                std::this_thread::get_id() != _thread.get_id()) {
+            // Calling fn here instead could overlap with the callback of
+            // the same key running on the dedicated thread.
+            _metrics.overflowed++;
+            _done.wait(lock, [this, key]() {
+                return _queued.empty() || _queued.size() < _max_queued ||
+                    _queued.count(key);
+            });
+            it = _queued.find(key);
+        }
+        if (it != _queued.end()) {
+            it->second = std::move(fn);
+            _metrics.coalesced++;
+        } else {
+            _queued[key] = std::move(fn);
+            _order.push_back(key);
+            _metrics.queued++;
+        }
+        _posted_seq++;
+    }
+    _wakeup.notify_one();
+}
+
+void CallbackExecutor::flush() {
+    if (std::this_thread::get_id() == _thread.get_id())
+        return;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t seq = _posted_seq;
+    _done.wait(lock, [this, seq]() { return _done_seq >= seq; });
+}
+
+void CallbackExecutor::set_max_queued(size_t max_queued) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _max_queued = max_queued;
+}
+
+CallbackMetrics CallbackExecutor::metrics() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    CallbackMetrics metrics = _metrics;
+    metrics.pending = _queued.size() + _running;
+    return metrics;
+}
+
+void CallbackExecutor::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _wakeup.wait(lock, [this]() { return _stopping || !_order.empty(); });
+        if (_order.empty())
+            break;  // i.e., stopping after all callbacks were called
+
+        const void *key = _order.front();
+        _order.pop_front();
+        auto fn = std::move(_queued[key]);
+        _queued.erase(key);
+        _running = true;
+        lock.unlock();
+
+        try {
+            fn();
+        } catch (const std::exception &ex) {
+            logger()->warn("callback failed; {}", ex.what());
+        }
+
+        lock.lock();
+        _running = false;
+        _metrics.dispatched++;
+        if (_order.empty())
+            _done_seq = _posted_seq;
+        _done.notify_all();
+    }
+}
+
+}  // namespace cpprestconfig
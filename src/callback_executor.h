@@ -0,0 +1,56 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_CALLBACK_EXECUTOR_H_
+#define SRC_CALLBACK_EXECUTOR_H_
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "cpprestconfig/cpprestconfig.h"
+
+namespace cpprestconfig {
+
+// Calls callbacks from a dedicated thread, so that slow ones do not hold up
+// the thread changing the value. Callbacks posted for a key that still has
+// one queued replace it, and the callbacks of a key are called in order.
+class CallbackExecutor {
+ public:
+    explicit CallbackExecutor(size_t max_queued);
+    ~CallbackExecutor();
+
+    // Blocks while max_queued other keys are queued, unless called from a
+    // callback, which queues regardless so as not to wait for itself.
+    void post(const void *key, std::function<void()> fn);
+
+    // Blocks until all callbacks posted so far have returned. Does not block
+    // if called from a callback.
+    void flush();
+
+    void set_max_queued(size_t max_queued);
+
+    CallbackMetrics metrics();
+
+ private:
+    void run();
+
+    std::mutex _mutex;
+    std::condition_variable _wakeup, _done;
+    std::map<const void *, std::function<void()>> _queued;
+    std::deque<const void *> _order;  // of keys in _queued
+    size_t _max_queued;
+    uint64_t _posted_seq, _done_seq;
+    CallbackMetrics _metrics;
+    bool _running;  // a callback, outside _mutex
+    bool _stopping;
+
+    std::thread _thread;
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_CALLBACK_EXECUTOR_H_
@@ -0,0 +1,25 @@
+// Copyright 2019 Cristian Klein
+#include "src/change_log.h"
+
+namespace cpprestconfig {
+
+void ChangeLog::publish(uint64_t generation) {
+    for (size_t id : _unpublished)
+        _changes.push_back(std::make_pair(generation, id));
+    _unpublished.clear();
+    while (_changes.size() > _capacity) {
+        _dropped = _changes.front().first;
+        _changes.pop_front();
+    }
+}
+
+bool ChangeLog::since(uint64_t since, std::vector<size_t> *ids) const {
+    for (auto it = _changes.rbegin(); it != _changes.rend(); ++it) {
+        if (it->first <= since)
+            break;
+        ids->push_back(it->second);
+    }
+    return since >= _dropped;
+}
+
+}  // namespace cpprestconfig
@@ -0,0 +1,41 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_CHANGE_LOG_H_
+#define SRC_CHANGE_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+namespace cpprestconfig {
+
+// Remembers which property ids changed in each of the latest generations,
+// so that watchers only need to be sent what changed since they last saw.
+class ChangeLog {
+ public:
+    explicit ChangeLog(size_t capacity) : _capacity(capacity), _dropped(0) {
+    }
+
+    // Records that id changed, in the next published generation.
+    void changed(size_t id) {
+        _unpublished.push_back(id);
+    }
+
+    void publish(uint64_t generation);
+
+    // Appends to ids the ids changed after generation since, possibly with
+    // duplicates. Returns false if some of them were already dropped.
+    bool since(uint64_t since, std::vector<size_t> *ids) const;
+
+ private:
+    size_t _capacity;
+    uint64_t _dropped;  // newest generation with dropped changes
+    std::deque<std::pair<uint64_t, size_t>> _changes;  // oldest first
+    std::vector<size_t> _unpublished;
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_CHANGE_LOG_H_
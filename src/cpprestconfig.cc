@@ -1,26 +1,47 @@
 // Copyright 2019 Cristian Klein
 #include "cpprestconfig/cpprestconfig.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <set>
+#include <thread>
+#include <typeinfo>
+#include <vector>
 
 #include <boost/filesystem.hpp>
-#include <boost/lexical_cast.hpp>
 #include "cpprest/http_listener.h"
 #include "cpprest/json.h"
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
-
-namespace boost {
-    template<>
-    bool lexical_cast<bool, std::string>(const std::string& arg) {
-        if (arg == "t" || arg == "1" || arg == "true")
-            return true;
-        if (arg == "f" || arg == "0" || arg == "false")
-            return false;
-        throw boost::bad_lexical_cast();
-    }
-}  // namespace boost
+#include "src/callback_executor.h"
+#include "src/change_log.h"
+#include "src/dir_watcher.h"
+#include "src/history.h"
+#include "src/key_index.h"
+#include "src/logger.h"
+#include "src/metrics.h"
+#include "src/parse.h"
+#include "src/persist.h"
+#include "src/read_stats.h"
+#include "src/shared_values.h"
+#include "src/snapshot.h"
+#include "src/unix_server.h"
 
 namespace cpprestconfig {
 
@@ -47,37 +68,194 @@ std::shared_ptr<spdlog::logger> logger() {
     return logger;
 }
 
+// Hot values are kept away from their metadata, in an arena of cache-line
+// sized slots. A reader of a value therefore never shares a cache line with
+// another value, with the strings of a ConfigProperty or with the nodes of
+// the map holding them. Slots are never freed nor moved, since handles point
+// into them.
+const size_t kCacheLineSize = 64;
+
+struct ValueSlot {
+    char storage[kCacheLineSize];
+};
+
+class ValueArena {
+ public:
+    template<typename T>
+    std::atomic<T> *allocate(T initial_value) {
+        static_assert(sizeof(std::atomic<T>) <= sizeof(ValueSlot),
+            "value does not fit in a slot");
+        return new (next_slot()) std::atomic<T>(initial_value);
+    }
+
+ private:
+    static const size_t kSlotsPerChunk = 1024;
+
+    void *next_slot() {
+        if (_next == _end) {
+            size_t size = (kSlotsPerChunk + 1) * sizeof(ValueSlot);
+            void *chunk = new char[size];
+            void *aligned = std::align(
+                kCacheLineSize,
+                kSlotsPerChunk * sizeof(ValueSlot),
+                chunk, size);
+            _next = static_cast<ValueSlot *>(aligned);
+            _end = _next + kSlotsPerChunk;
+        }
+        return _next++;
+    }
+
+    ValueSlot *_next = NULL;
+    ValueSlot *_end = NULL;
+};
+
+static ValueArena& value_arena() {
+    static ValueArena arena;
+    return arena;
+}
+
+// Values are stored as std::atomic<Stored<T>::type>. Strings are immutable
+// once stored, and replaced as a whole; old ones are retired through the
+// epoch domain, like snapshots.
 template<typename T>
-struct ConfigTypeProperty {
-    T value, default_value;
-    callback<T> _callback;
-    struct limits<T> _limits;
+struct Stored {
+    typedef T type;
+};
+
+template<>
+struct Stored<std::string> {
+    typedef const std::string *type;
 };
 
+// A value of any type, e.g., parsed but not yet assigned, or in a snapshot.
+// A parsed string is owned by its ConfigValue until assigned or discarded.
+union ConfigValue {
+    bool b;
+    int i;
+    int64_t l;
+    double d;
+    const std::string *s;
+};
+
+template<typename T>
+T &member(ConfigValue &v);  // NOLINT
+
+template<>
+bool &member<bool>(ConfigValue &v) {  // NOLINT
+    return v.b;
+}
+
+template<>
+int &member<int>(ConfigValue &v) {  // NOLINT
+    return v.i;
+}
+
+template<>
+int64_t &member<int64_t>(ConfigValue &v) {  // NOLINT
+    return v.l;
+}
+
+template<>
+double &member<double>(ConfigValue &v) {  // NOLINT
+    return v.d;
+}
+
+template<>
+const std::string *&member<const std::string *>(ConfigValue &v) {  // NOLINT
+    return v.s;
+}
+
+template<typename T>
+T read(const std::atomic<T> *value) {
+    return value->load(std::memory_order_relaxed);
+}
+
+// Must be called with registry_mutex() held, or in an epoch. Sequentially
+// consistent, so that the load is not ordered before entering the epoch.
+std::string read(const std::atomic<const std::string *> *value) {
+    return *value->load();
+}
+
+template<typename T>
+typename Stored<T>::type store(const T &value) {
+    return value;
+}
+
+const std::string *store(const std::string &value) {
+    return new std::string(value);
+}
+
 std::string to_string(bool b) {
     return b ? "true" : "false";
 }
 
+// As persisted, logged and read back by parse()
 template<typename T>
-std::string to_string(const ConfigTypeProperty<T> &cpt) {
-    return to_string(cpt.value);
+std::string value_to_string(T value) {
+    return to_string(value);
 }
 
-template<typename T>
-json::value to_json_value(const ConfigTypeProperty<T> &cpt) {
-    return json::value(cpt.value);
+std::string value_to_string(const std::string &s) {
+    return s;
+}
+
+// Same as value_to_string(), but into out, which is not reallocated if it
+// has enough capacity already.
+void format_value(bool b, std::string *out) {
+    out->assign(b ? "true" : "false");
+}
+
+void format_value(int64_t i, std::string *out) {
+    char buf[32];
+    out->assign(buf, snprintf(buf, sizeof(buf), "%" PRId64, i));
+}
+
+void format_value(int i, std::string *out) {
+    format_value(static_cast<int64_t>(i), out);
+}
+
+// The shortest of %.15g to %.17g that reads back as d: unlike
+// std::to_string, does not lose precision, yet shows 0.1 as such.
+void format_value(double d, std::string *out) {
+    char buf[32];
+    int size = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        size = snprintf(buf, sizeof(buf), "%.*g", precision, d);
+        if (strtod(buf, NULL) == d)
+            break;
+    }
+    out->assign(buf, size);
+}
+
+std::string value_to_string(double d) {
+    std::string s;
+    format_value(d, &s);
+    return s;
+}
+
+void format_value(const std::string *s, std::string *out) {
+    out->assign(*s);
 }
 
 template<typename T>
-json::value to_json_value_from_default(const ConfigTypeProperty<T> &cpt) {
-    return json::value(cpt.default_value);
+json::value to_json(T value) {
+    return json::value(value);
+}
+
+json::value to_json(const std::string &s) {
+    return json::value::string(s);
 }
 
 json::value to_json_limits(const struct limits<bool> &l) {
     return json::value();  // null JSON, bool has no limits
 }
 
-json::value to_json_limits(const struct limits<int> &l) {
+json::value to_json_limits(const struct limits<std::string> &l) {
+    return json::value();  // null JSON, string has no limits
+}
+
+template<typename T>
+json::value to_json_limits(const struct limits<T> &l) {
     auto o = json::value::object();
     o["min"] = json::value(l.min);
     o["max"] = json::value(l.max);
@@ -89,7 +267,28 @@ bool apply_limits(bool value, const struct limits<bool> &l) {
     return value;  // i.e., nothing
 }
 
-int apply_limits(int value, const struct limits<int> &l) {
+const std::string &apply_limits(
+    const std::string &value,
+    const struct limits<std::string> &l
+) {
+    return value;  // i.e., nothing
+}
+
+double apply_limits(double value, const struct limits<double> &l) {
+    if (!(l.min < l.max))  // i.e., no constraints
+        return value;
+    if (value < l.min)
+        return l.min;
+    if (value > l.max)
+        return l.max;
+    if (l.step > 0)
+        value = std::floor((value - l.min) / l.step) * l.step + l.min;
+    return value;
+}
+
+// For integers
+template<typename T>
+T apply_limits(T value, const struct limits<T> &l) {
     if (l.step == 0)  // i.e., no constraints
         return value;
     if (value < l.min)
@@ -102,321 +301,2169 @@ int apply_limits(int value, const struct limits<int> &l) {
 }
 
 template<typename T>
-void assign_from_string(
-    ConfigTypeProperty<T> *cpt,
-    const std::string &key,
-    const std::string &s
-) {
-    cpt->value = apply_limits(boost::lexical_cast<T>(s), cpt->_limits);
-    if (cpt->_callback) {
-        cpt->_callback(key.c_str(), cpt->value);
-    }
+const char *type_name();
+
+template<>
+const char *type_name<bool>() {
+    return "boolean";
 }
 
-enum ConfigType {
-    BOOL,
-    INT,
-};
+template<>
+const char *type_name<int>() {
+    return "integer";
+}
 
-std::string to_string(ConfigType c) {
-    switch (c) {
-        case BOOL:
-            return "boolean";
-        case INT:
-            return "integer";
-        default:
-            throw std::runtime_error("Unknown config type");
-    }
+template<>
+const char *type_name<int64_t>() {
+    return "integer64";
 }
 
-struct ConfigProperty {
-    std::string key, short_desc, long_desc;
-    ConfigType type;
-    ConfigTypeProperty<bool> bool_property;
-    ConfigTypeProperty<int> int_property;
-    Options options;
-};
+template<>
+const char *type_name<double>() {
+    return "double";
+}
 
-std::string to_string(const ConfigProperty &cp) {
-    switch (cp.type) {
-        case BOOL:
-            return to_string(cp.bool_property);
-        case INT:
-            return to_string(cp.int_property);
-        default:
-            throw std::runtime_error("Unknown config type");
-    }
+template<>
+const char *type_name<std::string>() {
+    return "string";
 }
 
-json::value to_json_limits(const ConfigProperty &cp) {
-    switch (cp.type) {
-        case BOOL:
-            return to_json_limits(cp.bool_property._limits);
-        case INT:
-            return to_json_limits(cp.int_property._limits);
-        default:
-            throw std::runtime_error("Unknown config type");
-    }
+void retire_on_publish(const std::string *s);
+
+template<typename T>
+void retire_on_publish(T) {
+    // only strings need to be retired
 }
 
-json::value to_json_value(const ConfigProperty &cp) {
-    switch (cp.type) {
-        case BOOL:
-            return to_json_value(cp.bool_property);
-        case INT:
-            return to_json_value(cp.int_property);
-        default:
-            throw std::runtime_error("Unknown config type");
+// The type-dependent part of a ConfigProperty.
+class ConfigTypeBase {
+ public:
+    virtual ~ConfigTypeBase() {}
+
+    virtual const char *type_name() const = 0;
+    virtual std::string to_string() const = 0;
+    virtual json::value to_json_value() const = 0;
+    virtual json::value to_json_value_from_default() const = 0;
+    virtual json::value to_json_limits() const = 0;
+
+    // Writes v as to_string() would, without allocating if possible.
+    virtual void format(ConfigValue v, std::string *out) const = 0;
+
+    // Throws parse_error if s is not a valid value.
+    virtual ConfigValue parse_from_string(string_ref s) const = 0;
+    virtual ConfigValue load_value() const = 0;
+
+    // Takes ownership of v, which must have been parsed by this property.
+    virtual void assign(ConfigValue v) = 0;
+
+    // Releases v, if it will not be assigned after all.
+    virtual void discard(ConfigValue v) const = 0;
+
+    virtual void notify(const std::string &key) const = 0;
+};
+
+template<typename T>
+class ConfigTypeProperty : public ConfigTypeBase {
+ public:
+    typedef typename Stored<T>::type stored_type;
+
+    std::atomic<stored_type> *value = NULL;  // points into value_arena()
+    T default_value;
+    callback<T> _callback;
+    struct limits<T> _limits;
+
+    T get() const {
+        return read(value);
     }
-}
 
-json::value to_json_value_from_default(const ConfigProperty &cp) {
-    switch (cp.type) {
-        case BOOL:
-            return to_json_value_from_default(cp.bool_property);
-        case INT:
-            return to_json_value_from_default(cp.int_property);
-        default:
-            throw std::runtime_error("Unknown config type");
+    void set(const T &v) {
+        ConfigValue cv;
+        member<stored_type>(cv) = store(v);
+        assign(cv);
     }
-}
 
-void assign_from_string(
-    ConfigProperty *cp,
-    const std::string &key,
-    const std::string &s
-) {
-    switch (cp->type) {
-        case BOOL:
-            assign_from_string(&cp->bool_property, key, s);
-            break;
-        case INT:
-            assign_from_string(&cp->int_property, key, s);
-            break;
-        default:
-            throw std::runtime_error("Unknown config type");
+    const char *type_name() const override {
+        return cpprestconfig::type_name<T>();
     }
-}
 
+    std::string to_string() const override {
+        return value_to_string(get());
+    }
 
-typedef std::map<std::string, ConfigProperty> ConfigProperties;
+    json::value to_json_value() const override {
+        return to_json(get());
+    }
 
-static ConfigProperties& config_properties() {
-    static ConfigProperties cp;
-    return cp;
-}
+    json::value to_json_value_from_default() const override {
+        return to_json(default_value);
+    }
 
-void loadPersist(ConfigProperty *cp);
-void savePersist(ConfigProperty *cp);
+    json::value to_json_limits() const override {
+        return cpprestconfig::to_json_limits(_limits);
+    }
 
-template<>
-bool& config(
-    bool default_value,
-    const char *key,
-    const char *short_desc,
-    const char *long_desc,
-    callback<bool> _callback,
-    limits<bool> _limits,
-    Options options
-) {
-    logger()->info("{}={}", key, default_value);
+    void format(ConfigValue v, std::string *out) const override {
+        format_value(member<stored_type>(v), out);
+    }
 
-    ConfigProperty &cp = config_properties()[key];
-    cp.key = key;
-    cp.short_desc = short_desc;
-    cp.long_desc = long_desc;
-    cp.options = options;
+    ConfigValue parse_from_string(string_ref s) const override {
+        ConfigValue v;
+        member<stored_type>(v) = store(apply_limits(parse<T>(s), _limits));
+        return v;
+    }
 
-    cp.type = BOOL;
-    cp.bool_property.value = default_value;
-    cp.bool_property.default_value = default_value;
-    cp.bool_property._callback = _callback;
-    cp.bool_property._limits = _limits;
+    ConfigValue load_value() const override {
+        ConfigValue v;
+        member<stored_type>(v) = value->load(std::memory_order_relaxed);
+        return v;
+    }
 
-    loadPersist(&cp);
+    void assign(ConfigValue v) override {
+        retire_on_publish(value->exchange(member<stored_type>(v)));
+    }
 
-    return cp.bool_property.value;
-}
+    void discard(ConfigValue v) const override {
+        retire_on_publish(member<stored_type>(v));
+    }
 
-template<>
-int& config<int>(
-    int default_value,
-    const char *key,
-    const char *short_desc,
-    const char *long_desc,
-    callback<int> _callback,
-    limits<int> _limits,
-    Options options
-) {
-    logger()->info("{}={}", key, default_value);
+    void notify(const std::string &key) const override {
+        if (_callback) {
+            _callback(key.c_str(), get());
+        }
+    }
+};
 
-    ConfigProperty &cp = config_properties()[key];
-    cp.key = key;
-    cp.short_desc = short_desc;
-    cp.long_desc = long_desc;
-    cp.options = options;
+// An int shown and set by name.
+class EnumProperty : public ConfigTypeProperty<int> {
+ public:
+    std::vector<std::pair<std::string, int>> names;
 
-    cp.type = INT;
-    cp.int_property.value = default_value;
-    cp.int_property.default_value = default_value;
-    cp.int_property._callback = _callback;
-    cp.int_property._limits = _limits;
+    const char *type_name() const override {
+        return "enum";
+    }
 
-    loadPersist(&cp);
+    std::string to_string() const override {
+        return name_of(get());
+    }
 
-    return cp.int_property.value;
-}
+    json::value to_json_value() const override {
+        return json::value::string(name_of(get()));
+    }
 
-void handle_get(http_request request) {
-    auto body = json::value::object();
+    json::value to_json_value_from_default() const override {
+        return json::value::string(name_of(default_value));
+    }
 
-    for (auto const & p : config_properties()) {
+    json::value to_json_limits() const override {
+        auto values = json::value::array(names.size());
+        for (size_t i = 0; i < names.size(); i++)
+            values[i] = json::value::string(names[i].first);
         auto o = json::value::object();
-        auto &cp = p.second;
-        o["short_desc"] = json::value::string(cp.short_desc);
-        o["long_desc"] = json::value::string(cp.long_desc);
-        o["default_value"] = to_json_value_from_default(cp);
-        o["value"] = to_json_value(cp);
-        o["type"] = json::value::string(to_string(cp.type));
+        o["values"] = values;
+        return o;
+    }
 
-        auto json_limits = to_json_limits(cp);
-        if (!json_limits.is_null()) {
-            o["limits"] = json_limits;
+    void format(ConfigValue v, std::string *out) const override {
+        for (auto const &name : names) {
+            if (name.second == v.i) {
+                out->assign(name.first);
+                return;
+            }
         }
+        format_value(v.i, out);  // not a named value
+    }
 
-        body[p.first] = o;
+    ConfigValue parse_from_string(string_ref s) const override {
+        for (auto const &name : names) {
+            if (s == name.first) {
+                ConfigValue v;
+                v.i = name.second;
+                return v;
+            }
+        }
+        throw parse_error("'" + s.str() + "' is not a valid enum");
     }
 
-    request.reply(status_codes::OK, body);
-}
+ private:
+    std::string name_of(int value) const {
+        for (auto const &name : names) {
+            if (name.second == value)
+                return name.first;
+        }
+        return std::to_string(value);  // not a named value
+    }
+};
 
-void handle_put(http_request request) {
-    auto const &path = uri::split_path(request.request_uri().path());
+// A double, between 0 and 100, read through handle<rollout>.
+class RolloutProperty : public ConfigTypeProperty<double> {
+ public:
+    const char *type_name() const override {
+        return "rollout";
+    }
+};
 
-    if (path.empty()) {
-        request.reply(
-            status_codes::BadRequest,
-            fmt::format("Got empty path in request"));
-        return;
+struct ConfigProperty {
+    ConfigProperty(size_t id, const std::string &key)
+        : id(id), key(key), options(Default) {
     }
 
-    const std::string &key = path.back();
-    const std::string new_value = request.extract_string().get();
-    ConfigProperty *cp = NULL;
+    const size_t id;  // e.g., index of this property in snapshots
+    const std::string &key;  // interned by ConfigProperties
+    std::string short_desc, long_desc;
+    std::unique_ptr<ConfigTypeBase> property;  // NULL until registered
+    Options options;
+    std::string rendered;  // JSON object served by GET, empty if stale
+};
 
-    try {
-        cp = &config_properties().at(key);
-        assign_from_string(cp, key, new_value);
-        savePersist(cp);
+// Bumped on every change visible through GET, protected by registry_mutex()
+uint64_t g_render_version = 0;
 
-        logger()->info("{}={}", key, to_string(*cp));
+// Must be called with registry_mutex() held, whenever cp changes.
+void invalidate_rendering(ConfigProperty *cp) {
+    cp->rendered.clear();
+    g_render_version++;
+}
 
-        request.reply(status_codes::OK);
-    } catch (const std::out_of_range &ex) {
-        request.reply(status_codes::NotFound,
-            fmt::format("Key {} not found", key));
-    } catch (const boost::bad_lexical_cast &ex) {
-        request.reply(status_codes::BadRequest,
-            fmt::format("Cannot convert '{}' to {}",
-                new_value,
-                to_string(cp->type)));
-    } catch (const std::exception &ex) {
-        request.reply(status_codes::InternalError, ex.what());
-    }
+std::string to_string(const ConfigProperty &cp) {
+    return cp.property->to_string();
 }
 
-std::unique_ptr<http_listener> g_listener;
-char *g_persistDir = NULL;
+json::value to_json_limits(const ConfigProperty &cp) {
+    return cp.property->to_json_limits();
+}
 
-void loadPersist(ConfigProperty *cp) {
-    if (!g_persistDir)
-        return;
-    if ((cp->options & Options::NoPersist))
-        return;
+json::value to_json_value(const ConfigProperty &cp) {
+    return cp.property->to_json_value();
+}
 
-    auto persistFile = (fs::path(g_persistDir) / cp->key).native();
+json::value to_json_value_from_default(const ConfigProperty &cp) {
+    return cp.property->to_json_value_from_default();
+}
 
-    std::ifstream ifs(persistFile);
-    if (!ifs.is_open()) {
-        logger()->info("Did not load {}; {} not found", cp->key, persistFile);
-        return;
+// Longest key and value that can be persisted, or 0 if unlimited.
+size_t g_persist_max_record = 0;  // protected by registry_mutex()
+
+// Must be called with registry_mutex() held. Also rejects values that
+// could not be persisted, rather than losing them on restart.
+ConfigValue parse_from_string(const ConfigProperty &cp, string_ref s) {
+    StageTimer timer(Stage::Parse);
+    ConfigValue v = cp.property->parse_from_string(s);
+    if (g_persist_max_record && !(cp.options & Options::NoPersist)) {
+        std::string persisted;
+        cp.property->format(v, &persisted);
+        if (cp.key.size() + persisted.size() > g_persist_max_record) {
+            cp.property->discard(v);
+            throw parse_error(fmt::format(
+                "Key {} and its value are longer than {} bytes, which can "
+                "be persisted", cp.key, g_persist_max_record));
+        }
     }
+    return v;
+}
 
-    try {
-        std::string value((std::istreambuf_iterator<char>(ifs)),
-            std::istreambuf_iterator<char>());
+ConfigValue load_value(const ConfigProperty &cp) {
+    return cp.property->load_value();
+}
+
+static ChangeLog& change_log() {
+    static ChangeLog log(4096);  // protected by registry_mutex()
+    return log;
+}
 
-        assign_from_string(cp, cp->key, value);
-        logger()->info("Loaded {} from {}", cp->key, persistFile);
-    } catch (const boost::bad_lexical_cast &ex) {
-        logger()->info("Did not loaded {} from {}; {}",
-            cp->key, persistFile, ex.what());
+static History& history() {
+    static History history(1024);  // protected by registry_mutex()
+    return history;
+}
+
+uint64_t g_generation = 0;  // protected by registry_mutex()
+
+// Must be called with registry_mutex() held, and followed by
+// publish_snapshot().
+void assign(ConfigProperty *cp, const ConfigValue &v, ChangeSource source) {
+    // Loading every key when starting would push the changes that could be
+    // rolled back out of the history.
+    if (source != ChangeSource::Persist) {
+        auto change = history().record(g_generation + 1, cp->id, source);
+        cp->property->format(cp->property->load_value(), &change->old_value);
+        cp->property->format(v, &change->new_value);
     }
+
+    invalidate_rendering(cp);
+    change_log().changed(cp->id);
+    cp->property->assign(v);
 }
 
-void savePersist(ConfigProperty *cp) {
-    if (!g_persistDir)
-        return;
-    if ((cp->options & Options::NoPersist))
-        return;
+void assign_from_string(ConfigProperty *cp, string_ref s,
+        ChangeSource source) {
+    assign(cp, parse_from_string(*cp, s), source);
+}
 
-    auto persistFile = (fs::path(g_persistDir) / cp->key).native();
+void notify_now(const ConfigProperty &cp) {
+    StageTimer timer(Stage::Callback);
+    cp.property->notify(cp.key);
+}
+
+CallbackExecutor *callback_executor(bool create);
 
-    std::ofstream ofs(persistFile);
-    if (!ofs.is_open()) {
-        logger()->info("saving {} (failed)", persistFile);
+// Calls the callback of cp from this or the callback thread, as asked.
+void notify(const ConfigProperty &cp) {
+    if (cp.options & Options::AsyncCallback) {
+        const ConfigProperty *p = &cp;  // never moved
+        callback_executor(true)->post(p, [p]() { notify_now(*p); });
         return;
     }
+    notify_now(cp);
+}
 
-    logger()->info("saving {}", persistFile);
+// Properties by id, in registration order, found by key through a hash
+// index over interned keys.
+class ConfigProperties {
+ public:
+    typedef std::deque<ConfigProperty>::iterator iterator;
 
-    std::string value = to_string(*cp);
-    ofs.write(value.c_str(), value.size());
-}
+    ConfigProperty *find(string_ref key) {
+        size_t id = _index.find(key.data(), key.size(),
+            key_hash(key.data(), key.size()));
+        return id == KeyIndex::npos ? NULL : &_properties[id];
+    }
 
-void start_server(
-    int port,
-    const char *basepath,
-    const char *persistDir
-) {
-    if (g_persistDir) {
-        free(g_persistDir);
+    // Returns the property for key, and whether it was created.
+    std::pair<ConfigProperty *, bool> insert(const char *key) {
+        return insert(key, key_hash(key));
     }
-    g_persistDir = NULL;
-    if (persistDir) {
-        g_persistDir = strdup(persistDir);
-        fs::create_directories(g_persistDir);
+
+    std::pair<ConfigProperty *, bool> insert(const char *key, uint64_t hash) {
+        auto inserted = _index.insert(key, strlen(key), hash);
+        size_t id = inserted.first;
+        if (inserted.second)
+            _properties.emplace_back(id, _index.key(id));
+        return std::make_pair(&_properties[id], inserted.second);
     }
 
-    logger()->info("current configuration is:");
-    for (auto &p : config_properties()) {
-        loadPersist(&p.second);
-        logger()->info("{}={}", p.first, to_string(p.second));
+    ConfigProperty &operator[](size_t id) {
+        return _properties[id];
     }
 
-    auto uri = uri_builder()
-        .set_scheme("http")
-        .set_host("localhost")
-        .set_port(port)
-        .set_path(basepath)
+    size_t size() const {
+        return _properties.size();
+    }
+
+    iterator begin() {
+        return _properties.begin();
+    }
+
+    iterator end() {
+        return _properties.end();
+    }
+
+    // Ids ordered by key
+    const std::vector<size_t> &sorted() const {
+        return _index.sorted();
+    }
+
+ private:
+    KeyIndex _index;
+    std::deque<ConfigProperty> _properties;  // never moved
+};
+
+// Keys declared with CPPRESTCONFIG_DEFINE and not imported yet, most
+// recently declared first.
+std::atomic<defined_base *> g_definitions(NULL);
+
+void import_definitions();
+
+static ConfigProperties& config_properties() {
+    static ConfigProperties cp;
+    if (g_definitions.load(std::memory_order_acquire))
+        import_definitions();
+    return cp;
+}
+
+// Protects config_properties() and serializes changes to values. Readers
+// going through handles or snapshots never take it.
+static std::mutex& registry_mutex() {
+    static std::mutex m;
+    return m;
+}
+
+// Epoch-based reclamation: a reader announces the epoch in which it started
+// reading, writers tag what they retire with the epoch in which it became
+// unreachable, and free it once every active reader started after that.
+struct EpochRecord {
+    std::atomic<uint64_t> epoch;  // 0 if the owning thread is not reading
+    std::atomic<bool> in_use;
+    int nesting;
+};
+
+struct EpochRecordOwner {
+    EpochRecord *record = NULL;
+    ~EpochRecordOwner() {
+        if (record)
+            record->in_use.store(false);
+    }
+};
+
+thread_local EpochRecord *tls_epoch_record = NULL;
+thread_local EpochRecordOwner tls_epoch_record_owner;
+
+class EpochDomain {
+ public:
+    void enter() {
+        EpochRecord *r = tls_epoch_record ? tls_epoch_record : acquire();
+        if (r->nesting++ == 0)
+            r->epoch.store(_epoch.load());
+    }
+
+    void exit() {
+        EpochRecord *r = tls_epoch_record;
+        if (--r->nesting == 0)
+            r->epoch.store(0, std::memory_order_release);
+    }
+
+    // Must be called after `deleter`'s object became unreachable for new
+    // readers. Calls to retire() must be serialized by the caller.
+    void retire(std::function<void()> deleter) {
+        _retired.push_back(Retired{_epoch.fetch_add(1) + 1, deleter});
+
+        uint64_t oldest = std::numeric_limits<uint64_t>::max();
+        {
+            std::lock_guard<std::mutex> lock(_records_mutex);
+            for (auto &r : _records) {
+                uint64_t e = r->epoch.load();
+                if (e != 0 && e < oldest)
+                    oldest = e;
+            }
+        }
+
+        auto reclaimable = std::stable_partition(
+            _retired.begin(), _retired.end(),
+            [oldest](const Retired &r) { return r.epoch > oldest; });
+        for (auto it = reclaimable; it != _retired.end(); ++it)
+            it->deleter();
+        _retired.erase(reclaimable, _retired.end());
+    }
+
+ private:
+    struct Retired {
+        uint64_t epoch;
+        std::function<void()> deleter;
+    };
+
+    EpochRecord *acquire() {
+        std::lock_guard<std::mutex> lock(_records_mutex);
+        EpochRecord *r = NULL;
+        for (auto &candidate : _records) {
+            if (!candidate->in_use.load()) {
+                r = candidate.get();
+                break;
+            }
+        }
+        if (!r) {
+            _records.push_back(make_unique<EpochRecord>());
+            r = _records.back().get();
+            r->epoch.store(0);
+        }
+        r->in_use.store(true);
+        r->nesting = 0;
+        tls_epoch_record_owner.record = r;
+        tls_epoch_record = r;
+        return r;
+    }
+
+    std::atomic<uint64_t> _epoch{1};
+    std::mutex _records_mutex;
+    std::vector<std::unique_ptr<EpochRecord>> _records;
+    std::vector<Retired> _retired;
+};
+
+static EpochDomain& epoch_domain() {
+    static EpochDomain *domain = new EpochDomain();  // outlives all threads
+    return *domain;
+}
+
+struct SnapshotData {
+    uint64_t generation;
+    std::vector<ConfigValue> values;  // indexed by ConfigProperty::id
+};
+
+std::atomic<const SnapshotData *> g_snapshot(NULL);
+
+// Strings replaced since the last publish_snapshot(); the current snapshot
+// may still point to them. Protected by registry_mutex().
+static std::vector<const std::string *>& replaced_strings() {
+    static std::vector<const std::string *> strings;
+    return strings;
+}
+
+void retire_on_publish(const std::string *s) {
+    if (s)
+        replaced_strings().push_back(s);
+}
+
+void notify_watchers();
+
+// Values shared with follower processes, protected by registry_mutex().
+std::unique_ptr<SharedValues> g_shared;
+
+// Must be called with registry_mutex() held. Writes the given properties to
+// the shared segment, then wakes up followers.
+void share_values(const std::vector<size_t> &ids) {
+    static std::string value;  // keeps its capacity between calls
+    for (size_t id : ids) {
+        auto const &cp = config_properties()[id];
+        cp.property->format(cp.property->load_value(), &value);
+        if (!g_shared->store(cp.key, key_hash(cp.key), value))
+            logger()->warn("Cannot share {}; key or value too long", cp.key);
+    }
+    g_shared->publish();
+}
+
+// Must be called with registry_mutex() held, after changing values.
+void publish_snapshot() {
+    // before taking a generation, since importing may publish values
+    import_definitions();
+
+    StageTimer timer(Stage::Publish);
+    auto data = new SnapshotData();
+    data->generation = ++g_generation;
+    change_log().publish(g_generation);
+    if (g_shared) {
+        std::vector<size_t> ids;
+        change_log().since(g_generation - 1, &ids);
+        share_values(ids);
+    }
+    data->values.reserve(config_properties().size());
+    for (auto const &cp : config_properties()) {
+        data->values.push_back(load_value(cp));
+    }
+
+    std::vector<const std::string *> replaced;
+    replaced.swap(replaced_strings());
+    const SnapshotData *old = g_snapshot.exchange(data);
+    if (old || !replaced.empty()) {
+        epoch_domain().retire([old, replaced]() {
+            delete old;
+            for (auto s : replaced)
+                delete s;
+        });
+    }
+
+    notify_watchers();
+}
+
+Snapshot::Snapshot(const SnapshotData *data) : _data(data), _reading(true) {
+}
+
+Snapshot::Snapshot(Snapshot &&other)
+    : _data(other._data), _reading(other._reading) {
+    other._reading = false;
+}
+
+Snapshot::~Snapshot() {
+    if (_reading)
+        epoch_domain().exit();
+}
+
+uint64_t Snapshot::generation() const {
+    return _data ? _data->generation : 0;
+}
+
+// Keys registered after a snapshot was published are read live; they did
+// not change since.
+// Values read from a Snapshot count as reads of their key, the same as
+// reading the handle would.
+inline void count_snapshot_read(size_t id) {
+#ifdef CPPRESTCONFIG_INSTRUMENT
+    count_read(id);
+#else
+    (void)id;
+#endif
+}
+
+bool Snapshot::get(const handle<bool> &h) const {
+    if (!_data || h.id() >= _data->values.size())
+        return h.get();
+    count_snapshot_read(h.id());
+    return _data->values[h.id()].b;
+}
+
+int Snapshot::get(const handle<int> &h) const {
+    if (!_data || h.id() >= _data->values.size())
+        return h.get();
+    count_snapshot_read(h.id());
+    return _data->values[h.id()].i;
+}
+
+int64_t Snapshot::get(const handle<int64_t> &h) const {
+    if (!_data || h.id() >= _data->values.size())
+        return h.get();
+    count_snapshot_read(h.id());
+    return _data->values[h.id()].l;
+}
+
+double Snapshot::get(const handle<double> &h) const {
+    if (!_data || h.id() >= _data->values.size())
+        return h.get();
+    count_snapshot_read(h.id());
+    return _data->values[h.id()].d;
+}
+
+std::string Snapshot::get(const handle<std::string> &h) const {
+    if (!_data || h.id() >= _data->values.size())
+        return h.get();
+    count_snapshot_read(h.id());
+    return *_data->values[h.id()].s;
+}
+
+int Snapshot::get_enum(size_t id, int live) const {
+    if (!_data || id >= _data->values.size())
+        return live;
+    return _data->values[id].i;
+}
+
+// Keeps the calling thread in an epoch while in scope.
+struct EpochReader {
+    EpochReader() {
+        epoch_domain().enter();
+    }
+
+    ~EpochReader() {
+        epoch_domain().exit();
+    }
+};
+
+std::string handle<std::string>::get() const {
+#ifdef CPPRESTCONFIG_INSTRUMENT
+    count_read(_id);
+#endif
+    EpochReader reader;
+    return read(_value);
+}
+
+Snapshot snapshot() {
+    epoch_domain().enter();
+    return Snapshot(g_snapshot.load());
+}
+
+bool loadPersist(ConfigProperty *cp);
+void savePersist(ConfigProperty *cp);
+void savePersist(const std::vector<ConfigProperty *> &cps);
+
+// Must be called with registry_mutex() held.
+ConfigProperty &register_property(
+    const char *key,
+    uint64_t hash,
+    const char *short_desc,
+    const char *long_desc,
+    Options options
+) {
+    ConfigProperty &cp = *config_properties().insert(key, hash).first;
+    invalidate_rendering(&cp);
+    cp.short_desc = short_desc;
+    cp.long_desc = long_desc;
+    cp.options = options;
+    return cp;
+}
+
+// Registers key with a property of type P, holding values of type T.
+// setup() completes P before persisted values are loaded.
+template<typename P, typename T>
+handle<T> register_config(
+    T default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    callback<T> _callback,
+    limits<T> _limits,
+    Options options,
+    std::function<void(P *)> setup = {}
+) {
+    logger()->info("{}={}", key, default_value);
+
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    ConfigProperty &cp = register_property(
+        key, key_hash(key), short_desc, long_desc, options);
+
+    P *p;
+    if (cp.property && typeid(*cp.property) == typeid(P)) {
+        p = static_cast<P *>(cp.property.get());
+        p->set(default_value);
+    } else {
+        // handles of a previous type keep pointing to their own slot
+        auto property = make_unique<P>();
+        p = property.get();
+        p->value = value_arena().allocate(store(default_value));
+        cp.property = std::move(property);
+    }
+    p->default_value = default_value;
+    p->_callback = _callback;
+    p->_limits = _limits;
+    if (setup)
+        setup(p);
+
+    bool loaded = loadPersist(&cp);
+    if (loaded)
+        publish_snapshot();
+    lock.unlock();
+
+    if (loaded)
+        notify(cp);
+
+    return handle<T>(p->value, cp.id);
+}
+
+template<>
+handle<bool> config(
+    bool default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    callback<bool> _callback,
+    limits<bool> _limits,
+    Options options
+) {
+    return register_config<ConfigTypeProperty<bool>>(default_value, key,
+        short_desc, long_desc, _callback, _limits, options);
+}
+
+template<>
+handle<int> config(
+    int default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    callback<int> _callback,
+    limits<int> _limits,
+    Options options
+) {
+    return register_config<ConfigTypeProperty<int>>(default_value, key,
+        short_desc, long_desc, _callback, _limits, options);
+}
+
+template<>
+handle<int64_t> config(
+    int64_t default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    callback<int64_t> _callback,
+    limits<int64_t> _limits,
+    Options options
+) {
+    return register_config<ConfigTypeProperty<int64_t>>(default_value, key,
+        short_desc, long_desc, _callback, _limits, options);
+}
+
+template<>
+handle<double> config(
+    double default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    callback<double> _callback,
+    limits<double> _limits,
+    Options options
+) {
+    return register_config<ConfigTypeProperty<double>>(default_value, key,
+        short_desc, long_desc, _callback, _limits, options);
+}
+
+template<>
+handle<std::string> config(
+    std::string default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    callback<std::string> _callback,
+    limits<std::string> _limits,
+    Options options
+) {
+    return register_config<ConfigTypeProperty<std::string>>(default_value,
+        key, short_desc, long_desc, _callback, _limits, options);
+}
+
+handle<int> config_enum(
+    int default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    const enum_names<int> &names,
+    callback<int> _callback,
+    Options options
+) {
+    return register_config<EnumProperty>(default_value, key, short_desc,
+        long_desc, _callback, limits<int>{0, 0, 0}, options,
+        std::function<void(EnumProperty *)>([&names](EnumProperty *p) {
+            p->names.assign(names.begin(), names.end());
+        }));
+}
+
+template<>
+handle<rollout> config(
+    rollout default_value,
+    const char *key,
+    const char *short_desc,
+    const char *long_desc,
+    callback<rollout> _callback,
+    limits<rollout> _limits,
+    Options options
+) {
+    limits<double> double_limits{0, 100, _limits.step};
+    if (_limits.min < _limits.max) {
+        double_limits.min = std::max(0.0, _limits.min);
+        double_limits.max = std::min(100.0, _limits.max);
+    }
+
+    callback<double> double_callback;
+    if (_callback) {
+        double_callback = [_callback](const char *key, double percent) {
+            _callback(key, rollout{percent});
+        };
+    }
+
+    handle<double> h = register_config<RolloutProperty>(
+        default_value.percent, key, short_desc, long_desc, double_callback,
+        double_limits, options);
+    double &storage = h;  // i.e., the representation of the atomic
+    return handle<rollout>(reinterpret_cast<std::atomic<double> *>(&storage),
+        h.id(), key_hash(key));
+}
+
+void defined_base::enlist() {
+    _next = g_definitions.load();
+    while (!g_definitions.compare_exchange_weak(_next, this)) {
+    }
+}
+
+constexpr size_t defined_base::kNotImported;
+
+size_t defined_base::id() const {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    config_properties();  // i.e., import pending keys
+    return _id;
+}
+
+// Registers a declared key, with the same metadata a call to config() would
+// have given, but pointing to the value held by the declaration. Nothing is
+// logged, since start_server() lists all keys anyway.
+template<typename T>
+bool defined<T>::import() {
+    const definition<T> &d = *_definition;
+    ConfigProperty &cp = register_property(
+        d.key, d.key_hash, d.short_desc, d.long_desc, d.options);
+
+    auto property = make_unique<ConfigTypeProperty<T>>();
+    property->value = &_value;
+    property->default_value = d.default_value;
+    property->_limits = d.limits;
+    cp.property = std::move(property);
+    _id = cp.id;
+
+    return loadPersist(&cp);
+}
+
+template class defined<bool>;
+template class defined<int>;
+template class defined<int64_t>;
+template class defined<double>;
+
+class DefinitionImporter {
+ public:
+    // Returns whether any persisted value was loaded.
+    static bool import(defined_base *list) {
+        // in declaration order, so that ids are assigned as with config()
+        defined_base *reversed = NULL;
+        while (list) {
+            defined_base *next = list->_next;
+            list->_next = reversed;
+            reversed = list;
+            list = next;
+        }
+        bool loaded = false;
+        for (defined_base *d = reversed; d; d = d->_next)
+            loaded = d->import() || loaded;
+        return loaded;
+    }
+};
+
+// Must be called with registry_mutex() held. Publishes the values loaded
+// for the imported keys right away, rather than with whichever change
+// comes next.
+void import_definitions() {
+    if (DefinitionImporter::import(g_definitions.exchange(NULL)))
+        publish_snapshot();
+}
+
+// Members of a property that GET may be asked to return with fields=...
+const std::set<std::string> &known_fields() {
+    static const std::set<std::string> fields = {
+        "short_desc", "long_desc", "default_value", "value", "type", "limits",
+    };
+    return fields;
+}
+
+// Renders the members of cp listed in fields, or all of them if empty.
+json::value to_json(const ConfigProperty &cp,
+        const std::set<std::string> &fields) {
+    auto selected = [&fields](const char *field) {
+        return fields.empty() || fields.count(field);
+    };
+
+    auto o = json::value::object();
+    if (selected("short_desc"))
+        o["short_desc"] = json::value::string(cp.short_desc);
+    if (selected("long_desc"))
+        o["long_desc"] = json::value::string(cp.long_desc);
+    if (selected("default_value"))
+        o["default_value"] = to_json_value_from_default(cp);
+    if (selected("value"))
+        o["value"] = to_json_value(cp);
+    if (selected("type"))
+        o["type"] = json::value::string(cp.property->type_name());
+
+    if (selected("limits")) {
+        auto json_limits = to_json_limits(cp);
+        if (!json_limits.is_null()) {
+            o["limits"] = json_limits;
+        }
+    }
+
+    return o;
+}
+
+// Must be called with registry_mutex() held.
+std::string render(ConfigProperty *cp, const std::set<std::string> &fields) {
+    if (!fields.empty())
+        return to_json(*cp, fields).serialize();
+    if (cp->rendered.empty())
+        cp->rendered = to_json(*cp, fields).serialize();
+    return cp->rendered;
+}
+
+// Must be called with registry_mutex() held. Renders the properties whose
+// key starts with prefix as a JSON object.
+std::string render(const std::string &prefix,
+        const std::set<std::string> &fields) {
+    auto &properties = config_properties();
+    auto const &sorted = properties.sorted();
+    auto it = std::lower_bound(sorted.begin(), sorted.end(), prefix,
+        [&properties](size_t id, const std::string &prefix) {
+            return properties[id].key < prefix;
+        });
+
+    std::string body = "{";
+    for (; it != sorted.end(); ++it) {
+        auto &cp = properties[*it];
+        if (cp.key.compare(0, prefix.size(), prefix) != 0)
+            break;
+        if (body.size() > 1)
+            body.push_back(',');
+        body.append(json::value::string(cp.key).serialize());
+        body.push_back(':');
+        body.append(render(&cp, fields));
+    }
+    body.push_back('}');
+    return body;
+}
+
+// The rendered body of an unfiltered GET, protected by registry_mutex().
+std::shared_ptr<const std::string> g_rendered_body;
+uint64_t g_rendered_version = 0;
+
+// Must be called with registry_mutex() held. Only properties changed since
+// the last call are rendered again.
+std::shared_ptr<const std::string> rendered_body() {
+    if (!g_rendered_body || g_rendered_version != g_render_version) {
+        g_rendered_body = std::make_shared<const std::string>(
+            render(std::string(), std::set<std::string>()));
+        g_rendered_version = g_render_version;
+    }
+    return g_rendered_body;
+}
+
+// Distinguishes ETags of different processes, whose versions restart at 0.
+const std::string &etag_prefix() {
+    static const std::string prefix = fmt::format(
+        "{:08x}", std::random_device()());
+    return prefix;
+}
+
+// Must be called with registry_mutex() held. Any response of GET stays
+// valid as long as this does not change.
+std::string current_etag() {
+    return fmt::format("\"{}-{}\"", etag_prefix(), g_render_version);
+}
+
+// Whether an If-None-Match header, i.e., a list of ETags, matches etag.
+bool etag_matches(const std::string &if_none_match, const std::string &etag) {
+    size_t begin = 0;
+    while (begin < if_none_match.size()) {
+        size_t end = if_none_match.find(',', begin);
+        if (end == std::string::npos)
+            end = if_none_match.size();
+
+        std::string candidate = if_none_match.substr(begin, end - begin);
+        candidate.erase(0, candidate.find_first_not_of(" \t"));
+        candidate.erase(candidate.find_last_not_of(" \t") + 1);
+        if (candidate.compare(0, 2, "W/") == 0)
+            candidate.erase(0, 2);
+        if (candidate == "*" || candidate == etag)
+            return true;
+
+        begin = end + 1;
+    }
+    return false;
+}
+
+// Must be called with registry_mutex() held. Renders the current generation
+// and the values changed after generation since, or all values if since is
+// unknown.
+std::string render_changes(uint64_t since) {
+    std::vector<size_t> ids;
+    if (since > g_generation || !change_log().since(since, &ids))
+        ids = config_properties().sorted();
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+    auto changes = json::value::object();
+    for (size_t id : ids) {
+        auto &cp = config_properties()[id];
+        changes[cp.key] = to_json_value(cp);
+    }
+
+    auto body = json::value::object();
+    body["generation"] = json::value::number(g_generation);
+    body["changes"] = changes;
+    return body.serialize();
+}
+
+void reply_json(const http_request &request, const std::string &body) {
+    http_response response(status_codes::OK);
+    response.set_body(body, "application/json");
+    request.reply(response);
+}
+
+// Pending long-poll requests, answered from a thread of their own, so that
+// publishing a change never waits for watchers.
+class Watchers {
+ public:
+    Watchers() : _changed(false), _stopping(false),
+        _thread(&Watchers::run, this) {
+    }
+
+    // Answers all pending requests.
+    ~Watchers() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stopping = true;
+        lock.unlock();
+        _cv.notify_one();
+        _thread.join();
+    }
+
+    // Must be called with registry_mutex() held.
+    void add(http_request request, uint64_t since,
+            std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _waiting.push_back(Watcher{request, since, deadline});
+        lock.unlock();
+        _cv.notify_one();
+    }
+
+    // Must be called with registry_mutex() held, after publishing.
+    void changed() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _changed = true;
+        lock.unlock();
+        _cv.notify_one();
+    }
+
+ private:
+    struct Watcher {
+        http_request request;
+        uint64_t since;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    void run();
+
+    // Locked after registry_mutex(), if both are needed.
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _changed, _stopping;
+    std::vector<Watcher> _waiting;
+    std::thread _thread;  // last, starts using the above
+};
+
+void Watchers::run() {
+    typedef std::chrono::steady_clock clock;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        auto deadline = clock::time_point::max();
+        for (auto const &w : _waiting)
+            deadline = std::min(deadline, w.deadline);
+        if (!_changed && !_stopping && deadline > clock::now()) {
+            if (deadline == clock::time_point::max())
+                _cv.wait(lock);
+            else
+                _cv.wait_until(lock, deadline);
+            continue;
+        }
+
+        bool stopping = _stopping;
+        std::vector<Watcher> waiting;
+        waiting.swap(_waiting);
+        _changed = false;
+        lock.unlock();
+
+        std::vector<std::pair<http_request, std::string>> replies;
+        std::unique_lock<std::mutex> registry_lock(registry_mutex());
+        auto now = clock::now();
+        for (auto &w : waiting) {
+            if (stopping || w.since != g_generation || w.deadline <= now)
+                replies.emplace_back(w.request, render_changes(w.since));
+            else
+                _waiting.push_back(w);  // add() also holds registry_mutex()
+        }
+        registry_lock.unlock();
+
+        for (auto const &reply : replies)
+            reply_json(reply.first, reply.second);
+        if (stopping)
+            return;
+        lock.lock();
+    }
+}
+
+std::unique_ptr<Watchers> g_watchers;  // protected by registry_mutex()
+
+void notify_watchers() {
+    if (g_watchers)
+        g_watchers->changed();
+}
+
+// Long-polls for changes: replies as soon as the generation differs from
+// since, or after timeout seconds, with the current generation and the
+// values changed after since.
+void handle_watch(http_request request) {
+    auto const &query = uri::split_query(request.request_uri().query());
+
+    uint64_t since = 0;
+    int timeout = 30;
+    try {
+        for (auto const &parameter : query) {
+            std::string value = uri::decode(parameter.second);
+            if (parameter.first == "since") {
+                since = parse<uint64_t>(value);
+            } else if (parameter.first == "timeout") {
+                timeout = std::max(0, std::min(
+                    parse<int>(value), 300));
+            } else {
+                request.reply(status_codes::BadRequest,
+                    fmt::format("Unknown parameter '{}'", parameter.first));
+                return;
+            }
+        }
+    } catch (const parse_error &ex) {
+        request.reply(status_codes::BadRequest,
+            fmt::format("Cannot convert '{}' to integer",
+                request.request_uri().query()));
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    if (since == g_generation && timeout > 0 && g_watchers) {
+        g_watchers->add(request, since,
+            std::chrono::steady_clock::now() + std::chrono::seconds(timeout));
+        return;
+    }
+    std::string body = render_changes(since);
+    lock.unlock();
+
+    reply_json(request, body);
+}
+
+// Must be called with registry_mutex() held. Finds the property of a key
+// given in a request.
+ConfigProperty *lookup(string_ref key) {
+    StageTimer timer(Stage::Lookup);
+    return config_properties().find(key);
+}
+
+// Replies with the current generation and the latest changes, oldest
+// first, with values as persisted.
+void handle_history(http_request request) {
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    auto changes = json::value::array();
+    size_t i = 0;
+    history().for_each([&changes, &i](const History::Change &change) {
+        auto c = json::value::object();
+        c["generation"] = json::value::number(change.generation);
+        c["key"] = json::value::string(config_properties()[change.id].key);
+        c["old_value"] = json::value::string(change.old_value);
+        c["new_value"] = json::value::string(change.new_value);
+        c["time"] = json::value::number(change.time_ms);
+        c["source"] = json::value::string(source_name(change.source));
+        changes[i++] = c;
+    });
+    auto body = json::value::object();
+    body["generation"] = json::value::number(g_generation);
+    body["changes"] = changes;
+    lock.unlock();
+
+    reply_json(request, body.serialize());
+}
+
+// Replies with the reads of each key, summed over all threads, and when it
+// was last read, in milliseconds since the Unix epoch.
+void handle_stats(http_request request) {
+#ifdef CPPRESTCONFIG_INSTRUMENT
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    auto &properties = config_properties();
+    auto stats = read_stats(properties.size());
+
+    auto body = json::value::object();
+    for (size_t id : properties.sorted()) {
+        auto entry = json::value::object();
+        entry["reads"] = json::value::number(stats[id].reads);
+        entry["last_read"] = stats[id].last_read_ms ?
+            json::value::number(stats[id].last_read_ms) : json::value::null();
+        body[properties[id].key] = entry;
+    }
+    lock.unlock();
+
+    reply_json(request, body.serialize());
+#else
+    request.reply(status_codes::NotFound,
+        "Read statistics need building with -DCPPRESTCONFIG_INSTRUMENT=ON");
+#endif
+}
+
+// Replies with the values of all keys as a binary snapshot, see
+// SnapshotWriter.
+void handle_snapshot_get(http_request request) {
+    std::string body;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    auto &properties = config_properties();
+    std::vector<size_t> ids;
+    for (size_t id : properties.sorted()) {
+        if (properties[id].property)
+            ids.push_back(id);
+    }
+
+    std::string value;
+    body.reserve(32 * ids.size());
+    SnapshotWriter writer(&body, ids.size(), g_generation);
+    for (size_t id : ids) {
+        const ConfigProperty &cp = properties[id];
+        cp.property->format(cp.property->load_value(), &value);
+        writer.add(cp.key, cp.property->type_name(), value);
+    }
+    lock.unlock();
+
+    http_response response(status_codes::OK);
+    response.set_body(std::move(body), "application/octet-stream");
+    request.reply(response);
+}
+
+// Serves the listing of all keys, GET <base>?prefix=... for the keys
+// starting with a prefix and GET <base>/<key> for a single key. Adding
+// fields=value,... returns only these members of each property. GET
+// <base>/watch waits for changes, see handle_watch(). GET <base>/_stats
+// returns read statistics, GET <base>/_history the latest changes and GET
+// <base>/_snapshot all values in binary.
+void handle_get(http_request request) {
+    auto const &path = uri::split_path(request.relative_uri().path());
+    if (path.size() == 1 && path[0] == "watch") {
+        handle_watch(request);
+        return;
+    }
+    if (path.size() == 1 && path[0] == "_stats") {
+        handle_stats(request);
+        return;
+    }
+    if (path.size() == 1 && path[0] == "_history") {
+        handle_history(request);
+        return;
+    }
+    if (path.size() == 1 && path[0] == "_snapshot") {
+        handle_snapshot_get(request);
+        return;
+    }
+    auto const &query = uri::split_query(request.request_uri().query());
+
+    std::string prefix;
+    std::set<std::string> fields;
+    for (auto const &parameter : query) {
+        std::string value = uri::decode(parameter.second);
+        if (parameter.first == "prefix") {
+            prefix = value;
+        } else if (parameter.first == "fields") {
+            size_t begin = 0;
+            while (begin <= value.size()) {
+                size_t end = std::min(value.find(',', begin), value.size());
+                std::string field = value.substr(begin, end - begin);
+                if (!known_fields().count(field)) {
+                    request.reply(status_codes::BadRequest,
+                        fmt::format("Unknown field '{}'", field));
+                    return;
+                }
+                fields.insert(field);
+                begin = end + 1;
+            }
+        } else {
+            request.reply(status_codes::BadRequest,
+                fmt::format("Unknown parameter '{}'", parameter.first));
+            return;
+        }
+    }
+
+    std::shared_ptr<const std::string> body;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    if (!path.empty()) {
+        const std::string &key = path.back();
+        ConfigProperty *cp = lookup(key);
+        if (!cp) {
+            lock.unlock();
+            request.reply(status_codes::NotFound,
+                fmt::format("Key {} not found", key));
+            return;
+        }
+        body = std::make_shared<const std::string>(render(cp, fields));
+    } else if (prefix.empty() && fields.empty()) {
+        body = rendered_body();
+    } else {
+        body = std::make_shared<const std::string>(render(prefix, fields));
+    }
+    std::string etag = current_etag();
+    lock.unlock();
+
+    std::string if_none_match;
+    if (request.headers().match(header_names::if_none_match, if_none_match) &&
+            etag_matches(if_none_match, etag)) {
+        http_response response(status_codes::NotModified);
+        response.headers().add(header_names::etag, etag);
+        request.reply(response);
+        return;
+    }
+
+    http_response response(status_codes::OK);
+    response.headers().add(header_names::etag, etag);
+    response.set_body(*body, "application/json");
+    request.reply(response);
+}
+
+void handle_snapshot_put(http_request request);
+
+// PUT <base>/<key> changes a single key. PUT <base>/_snapshot restores
+// the values of a snapshot, see handle_snapshot_put().
+void handle_put(http_request request) {
+    auto const &path = uri::split_path(request.request_uri().path());
+
+    if (path.empty()) {
+        request.reply(
+            status_codes::BadRequest,
+            fmt::format("Got empty path in request"));
+        return;
+    }
+    auto const &relative = uri::split_path(request.relative_uri().path());
+    if (relative.size() == 1 && relative[0] == "_snapshot") {
+        handle_snapshot_put(request);
+        return;
+    }
+
+    const std::string &key = path.back();
+    // unlike extract_string(), neither converts nor copies again
+    const std::vector<unsigned char> body = request.extract_vector().get();
+    string_ref new_value(
+        reinterpret_cast<const char *>(body.data()), body.size());
+    ConfigProperty *cp = NULL;
+
+    try {
+        std::unique_lock<std::mutex> lock(registry_mutex());
+        cp = lookup(key);
+        if (!cp) {
+            lock.unlock();
+            request.reply(status_codes::NotFound,
+                fmt::format("Key {} not found", key));
+            return;
+        }
+        assign_from_string(cp, new_value, ChangeSource::Put);
+        publish_snapshot();
+        savePersist(cp);
+
+        logger()->info("{}={}", key, to_string(*cp));
+        lock.unlock();
+
+        notify(*cp);
+
+        request.reply(status_codes::OK);
+    } catch (const parse_error &ex) {
+        request.reply(status_codes::BadRequest,
+            fmt::format("Cannot convert '{}' to {}",
+                new_value.str(),
+                cp->property->type_name()));
+    } catch (const std::exception &ex) {
+        request.reply(status_codes::InternalError, ex.what());
+    }
+}
+
+typedef std::vector<std::pair<ConfigProperty *, ConfigValue>> Changes;
+
+// Must be called with registry_mutex() held by lock. Assigns the parsed
+// changes, then publishes, persists and logs them together. Returns the
+// generation they were published with, after unlocking and calling the
+// callbacks.
+uint64_t apply_changes(const Changes &changes, ChangeSource source,
+        std::unique_lock<std::mutex> *lock) {
+    std::vector<ConfigProperty *> changed;
+    std::string summary;
+    for (auto const &c : changes) {
+        assign(c.first, c.second, source);
+        changed.push_back(c.first);
+        summary += fmt::format("{}{}={}",
+            summary.empty() ? "" : ", ", c.first->key, to_string(*c.first));
+    }
+    publish_snapshot();
+    savePersist(changed);
+    uint64_t generation = g_generation;
+
+    logger()->info("{}", summary);
+    lock->unlock();
+
+    for (auto cp : changed)
+        notify(*cp);
+    return generation;
+}
+
+// Applies a JSON object of key/value pairs as a single change: every value
+// is validated before any is assigned, then all of them are published,
+// persisted and logged together.
+void handle_batch(http_request request) {
+    if (!uri::split_path(request.relative_uri().path()).empty()) {
+        request.reply(
+            status_codes::BadRequest,
+            fmt::format("Batch changes must be sent to the base path"));
+        return;
+    }
+
+    json::value body;
+    try {
+        body = request.extract_json(true).get();
+    } catch (const std::exception &ex) {
+        request.reply(status_codes::BadRequest,
+            fmt::format("Cannot parse body; {}", ex.what()));
+        return;
+    }
+    if (!body.is_object()) {
+        request.reply(status_codes::BadRequest,
+            fmt::format("Expected an object of key/value pairs"));
+        return;
+    }
+
+    Changes changes;
+    auto discard_changes = [&changes]() {
+        for (auto const &c : changes)
+            c.first->property->discard(c.second);
+    };
+
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    for (auto const &field : body.as_object()) {
+        const std::string &key = field.first;
+        const json::value &v = field.second;
+        const std::string serialized = v.is_string() ? "" : v.serialize();
+        string_ref new_value(v.is_string() ? v.as_string() : serialized);
+
+        ConfigProperty *cp = lookup(key);
+        if (!cp) {
+            discard_changes();
+            lock.unlock();
+            request.reply(status_codes::NotFound,
+                fmt::format("Key {} not found", key));
+            return;
+        }
+
+        try {
+            changes.push_back(
+                std::make_pair(cp, parse_from_string(*cp, new_value)));
+        } catch (const parse_error &ex) {
+            discard_changes();
+            lock.unlock();
+            request.reply(status_codes::BadRequest,
+                fmt::format("Cannot convert '{}' to {} for key {}",
+                    new_value.str(),
+                    cp->property->type_name(),
+                    key));
+            return;
+        }
+    }
+
+    apply_changes(changes, ChangeSource::Batch, &lock);
+
+    request.reply(status_codes::OK);
+}
+
+// Restores the values as of generation to=..., as a single change. This is
+// only possible while all changes after it are in the history.
+void handle_rollback(http_request request) {
+    auto const &query = uri::split_query(request.request_uri().query());
+
+    uint64_t to = 0;
+    bool has_to = false;
+    try {
+        for (auto const &parameter : query) {
+            if (parameter.first == "to") {
+                to = parse<uint64_t>(uri::decode(parameter.second));
+                has_to = true;
+            } else {
+                request.reply(status_codes::BadRequest,
+                    fmt::format("Unknown parameter '{}'", parameter.first));
+                return;
+            }
+        }
+    } catch (const parse_error &ex) {
+        request.reply(status_codes::BadRequest,
+            fmt::format("Cannot convert '{}' to integer",
+                request.request_uri().query()));
+        return;
+    }
+    if (!has_to) {
+        request.reply(status_codes::BadRequest,
+            fmt::format("Missing parameter 'to'"));
+        return;
+    }
+
+    std::map<size_t, std::string> values;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    if (to > g_generation) {
+        lock.unlock();
+        request.reply(status_codes::BadRequest,
+            fmt::format("Generation {} was not published yet", to));
+        return;
+    }
+    if (!history().values_at(to, &values)) {
+        lock.unlock();
+        request.reply(status_codes::Conflict,
+            fmt::format("Changes after generation {} are no longer in the "
+                "history", to));
+        return;
+    }
+
+    Changes changes;
+    for (auto const &v : values) {
+        ConfigProperty *cp = &config_properties()[v.first];
+        try {
+            changes.push_back(
+                std::make_pair(cp, parse_from_string(*cp, v.second)));
+        } catch (const parse_error &ex) {
+            // e.g., the key was registered again with another type
+            for (auto const &c : changes)
+                c.first->property->discard(c.second);
+            lock.unlock();
+            request.reply(status_codes::Conflict,
+                fmt::format("Cannot restore {}; {}", cp->key, ex.what()));
+            return;
+        }
+    }
+
+    uint64_t generation = g_generation;
+    if (changes.empty())
+        lock.unlock();
+    else
+        generation = apply_changes(changes, ChangeSource::Rollback, &lock);
+
+    auto body = json::value::object();
+    body["generation"] = json::value::number(generation);
+    reply_json(request, body.serialize());
+}
+
+// Applies the values of a snapshot, as returned by GET <base>/_snapshot,
+// as a single change. Every value is validated, against the type of its
+// key too, before any is assigned.
+void handle_snapshot_put(http_request request) {
+    const std::vector<unsigned char> body = request.extract_vector().get();
+
+    Changes changes;
+    auto discard_changes = [&changes]() {
+        for (auto const &c : changes)
+            c.first->property->discard(c.second);
+    };
+
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    try {
+        SnapshotReader reader(
+            reinterpret_cast<const char *>(body.data()), body.size());
+        // the count is not trusted: each value takes at least 7 bytes
+        changes.reserve(std::min<size_t>(reader.count(), body.size() / 7));
+        string_ref key(""), type(""), value("");
+        while (reader.next(&key, &type, &value)) {
+            ConfigProperty *cp = lookup(key);
+            if (!cp || !cp->property) {
+                discard_changes();
+                lock.unlock();
+                request.reply(status_codes::NotFound,
+                    fmt::format("Key {} not found", key.str()));
+                return;
+            }
+            if (!(type == cp->property->type_name())) {
+                throw parse_error(fmt::format("Key {} is of type {}, not {}",
+                    cp->key, cp->property->type_name(), type.str()));
+            }
+            changes.push_back(
+                std::make_pair(cp, parse_from_string(*cp, value)));
+        }
+    } catch (const parse_error &ex) {
+        discard_changes();
+        lock.unlock();
+        request.reply(status_codes::BadRequest,
+            fmt::format("Cannot restore snapshot; {}", ex.what()));
+        return;
+    } catch (const std::exception &ex) {
+        discard_changes();
+        lock.unlock();
+        logger()->warn("Cannot restore snapshot; {}", ex.what());
+        request.reply(status_codes::BadRequest,
+            fmt::format("Cannot restore snapshot; {}", ex.what()));
+        return;
+    }
+
+    uint64_t generation = g_generation;
+    if (changes.empty())
+        lock.unlock();
+    else
+        generation = apply_changes(changes, ChangeSource::Snapshot, &lock);
+
+    auto reply = json::value::object();
+    reply["generation"] = json::value::number(generation);
+    reply_json(request, reply.serialize());
+}
+
+// POST <base>/_rollback rolls back, see handle_rollback(); POST <base>
+// changes several keys, see handle_batch().
+void handle_post(http_request request) {
+    auto const &path = uri::split_path(request.relative_uri().path());
+    if (path.size() == 1 && path[0] == "_rollback") {
+        handle_rollback(request);
+        return;
+    }
+    handle_batch(request);
+}
+
+// Mirrors the values shared by another process into this one, so that
+// handles read them at memory speed and callbacks are called as usual.
+class Follower {
+ public:
+    explicit Follower(const std::string &name)
+        : _name(name),
+          _unregistered(false),
+          _stopping(false),
+          _thread(&Follower::run, this) {
+    }
+
+    ~Follower() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stopping = true;
+        if (_shared)
+            _shared->wake();
+        lock.unlock();
+        _stopped.notify_one();
+        _thread.join();
+    }
+
+ private:
+    void run();
+    void follow();
+    void apply();
+
+    std::string _name;
+    std::vector<uint32_t> _seqs;  // of the slots applied so far
+    bool _unregistered;  // whether apply() skipped keys not registered yet
+
+    std::mutex _mutex;
+    std::condition_variable _stopped;
+    bool _stopping;
+    std::unique_ptr<SharedValues> _shared;  // set by run(), under _mutex
+    std::thread _thread;  // last, starts using the above
+};
+
+void Follower::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stopping) {
+        if (_shared) {
+            lock.unlock();
+            follow();
+            lock.lock();
+            if (_shared->removed()) {
+                logger()->info("{} was removed; waiting for it again", _name);
+                _shared.reset();
+            }
+            continue;
+        }
+
+        lock.unlock();
+        std::unique_ptr<SharedValues> shared;
+        try {
+            shared = SharedValues::open(_name);
+        } catch (const std::exception &ex) {
+            logger()->warn("Cannot follow {}; {}", _name, ex.what());
+        }
+        lock.lock();
+        if (shared) {
+            _shared = std::move(shared);
+            _seqs.clear();  // of the previous segment, if any
+            logger()->info("following {}", _name);
+        } else {
+            // e.g., the process sharing values did not start yet
+            _stopped.wait_for(lock, std::chrono::seconds(1));
+        }
+    }
+}
+
+// Applies changes until stopping, or until the segment is removed.
+void Follower::follow() {
+    uint32_t seen = _shared->generation() - 1;
+    while (true) {
+        bool removed = _shared->removed();  // after its last changes
+        uint32_t generation = _shared->generation();
+        if (generation != seen) {
+            seen = generation;
+            apply();
+        } else if (removed) {
+            break;
+        } else {
+            _shared->wait(seen, std::chrono::seconds(1));
+            // also retries keys that this process did not register yet
+            if (_unregistered && _shared->generation() == seen)
+                apply();
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopping)
+            break;
+    }
+}
+
+// Applies the values changed since the last call, as a single change.
+void Follower::apply() {
+    Changes changes;
+    std::string current;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    _unregistered = false;
+    _shared->changed(&_seqs, [this, &changes, &current](
+            const std::string &key, const std::string &value) {
+        ConfigProperty *cp = config_properties().find(key);
+        if (!cp || !cp->property) {
+            _unregistered = true;
+            return false;  // offered again once registered
+        }
+        cp->property->format(cp->property->load_value(), &current);
+        if (current == value)
+            return true;
+        try {
+            changes.push_back(
+                std::make_pair(cp, parse_from_string(*cp, value)));
+        } catch (const parse_error &ex) {
+            logger()->warn("Cannot follow {}; {}", cp->key, ex.what());
+        }
+        return true;
+    });
+    if (changes.empty())
+        return;
+    apply_changes(changes, ChangeSource::Shared, &lock);
+}
+
+std::unique_ptr<Follower> g_follower;  // protected by registry_mutex()
+
+void start_sharing(const char *name) {
+    auto shared = SharedValues::create(name);
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    g_shared = std::move(shared);
+    share_values(config_properties().sorted());
+    logger()->info("sharing values in {}", name);
+}
+
+void stop_sharing() {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    if (!g_shared)
+        return;
+    try {
+        g_shared->remove();
+    } catch (const std::exception &ex) {
+        logger()->warn("Cannot stop sharing; {}", ex.what());
+    }
+    g_shared.reset();
+}
+
+void start_following(const char *name) {
+    stop_following();
+    auto follower = make_unique<Follower>(name);
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    g_follower = std::move(follower);
+}
+
+void stop_following() {
+    std::unique_ptr<Follower> follower;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    follower.swap(g_follower);
+    lock.unlock();
+    follower.reset();  // joins, unless applying changes
+}
+
+// Applies the values of the given key files as a single change, skipping
+// unknown keys, unchanged values and values that do not parse.
+void reload_key_files(const std::string &dir,
+        const std::vector<std::string> &names) {
+    std::vector<std::pair<std::string, std::string>> values;
+    std::string value;
+    for (auto const &name : names) {
+        if (read_key_file((fs::path(dir) / name).native(), &value))
+            values.push_back(std::make_pair(name, value));
+    }
+
+    Changes changes;
+    std::string current;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    for (auto const &v : values) {
+        ConfigProperty *cp = config_properties().find(v.first);
+        if (!cp || !cp->property)
+            continue;
+        cp->property->format(cp->property->load_value(), &current);
+        if (current == v.second)
+            continue;
+        try {
+            changes.push_back(
+                std::make_pair(cp, parse_from_string(*cp, v.second)));
+        } catch (const parse_error &ex) {
+            logger()->warn("Cannot reload {}; {}", cp->key, ex.what());
+        }
+    }
+    if (changes.empty())
+        return;
+    apply_changes(changes, ChangeSource::File, &lock);
+}
+
+std::unique_ptr<DirWatcher> g_dir_watcher;
+
+std::unique_ptr<http_listener> g_listener;
+std::unique_ptr<http_listener> g_metrics_listener;
+std::shared_ptr<PersistWriter> g_persist;  // protected by registry_mutex()
+std::chrono::milliseconds g_persist_interval(100);
+
+bool loadPersist(ConfigProperty *cp) {
+    if (!g_persist)
+        return false;
+    if ((cp->options & Options::NoPersist))
+        return false;
+
+    std::string value;
+    if (!g_persist->load(cp->key, &value)) {
+        logger()->info("Did not load {}; not persisted", cp->key);
+        return false;
+    }
+
+    try {
+        assign_from_string(cp, value, ChangeSource::Persist);
+        logger()->info("Loaded {}", cp->key);
+        return true;
+    } catch (const parse_error &ex) {
+        logger()->info("Did not loaded {}; {}", cp->key, ex.what());
+        return false;
+    }
+}
+
+// Must be called with registry_mutex() held. Same as loadPersist() for
+// each of ids, with a single lookup pass. Returns the loaded properties.
+std::vector<ConfigProperty *> loadPersist(const std::vector<size_t> &ids) {
+    std::vector<ConfigProperty *> cps;
+    std::vector<const std::string *> keys;
+    for (size_t id : ids) {
+        ConfigProperty &cp = config_properties()[id];
+        if (!(cp.options & Options::NoPersist)) {
+            cps.push_back(&cp);
+            keys.push_back(&cp.key);
+        }
+    }
+
+    std::vector<ConfigProperty *> loaded;
+    g_persist->load(keys, [&cps, &loaded](size_t i, const std::string &value) {
+        try {
+            assign_from_string(cps[i], value, ChangeSource::Persist);
+            loaded.push_back(cps[i]);
+        } catch (const parse_error &ex) {
+            logger()->info("Did not load {}; {}", cps[i]->key, ex.what());
+        }
+    });
+    logger()->info("Loaded {} of {} persisted keys", loaded.size(),
+        keys.size());
+    return loaded;
+}
+
+void savePersist(ConfigProperty *cp) {
+    savePersist(std::vector<ConfigProperty *>{cp});
+}
+
+// Only enqueues values; they are written by a background thread.
+void savePersist(const std::vector<ConfigProperty *> &cps) {
+    if (!g_persist)
+        return;
+
+    PersistValues values;
+    for (auto cp : cps) {
+        if (!(cp->options & Options::NoPersist))
+            values.push_back(std::make_pair(cp->key, to_string(*cp)));
+    }
+    if (!values.empty())
+        g_persist->enqueue(values);
+}
+
+void set_persist_interval(int milliseconds) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    g_persist_interval = std::chrono::milliseconds(milliseconds);
+}
+
+// Never deleted, as callbacks may be called until the process exits.
+CallbackExecutor *g_callback_executor = NULL;  // protected by registry_mutex()
+size_t g_callback_queue_limit = 1024;  // protected by registry_mutex()
+
+// Returns NULL if not created yet, i.e., no callback was asynchronous.
+CallbackExecutor *callback_executor(bool create) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    if (!g_callback_executor && create)
+        g_callback_executor = new CallbackExecutor(g_callback_queue_limit);
+    return g_callback_executor;
+}
+
+void set_callback_queue_limit(size_t max_queued) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    g_callback_queue_limit = max_queued;
+    if (g_callback_executor)
+        g_callback_executor->set_max_queued(max_queued);
+}
+
+CallbackMetrics callback_metrics() {
+    auto executor = callback_executor(false);
+    return executor ? executor->metrics() : CallbackMetrics();
+}
+
+void flush() {
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    std::shared_ptr<PersistWriter> persist = g_persist;
+    lock.unlock();
+
+    if (persist)
+        persist->flush();
+
+    auto executor = callback_executor(false);
+    if (executor)
+        executor->flush();
+}
+
+// Serves the metrics of this server, for Prometheus to scrape.
+void handle_metrics(http_request request) {
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    size_t keys = config_properties().size();
+    lock.unlock();
+
+    http_response response(status_codes::OK);
+    response.set_body(render_metrics(keys, callback_metrics()),
+        "text/plain; version=0.0.4");
+    request.reply(response);
+}
+
+// Counts the reply of handler to each request, whenever it is sent, e.g.,
+// after a watch times out.
+std::function<void(http_request)> counted(void (*handler)(http_request)) {
+    return [handler](http_request request) {
+        auto start = std::chrono::steady_clock::now();
+        method m = request.method();
+        handler(request);
+        request.get_response().then(
+            [m, start](pplx::task<http_response> response) {
+                try {
+                    count_request(m, response.get().status_code(),
+                        std::chrono::steady_clock::now() - start);
+                } catch (const std::exception &) {
+                    // never replied, e.g., the connection was closed
+                }
+            });
+    };
+}
+
+// Loads persisted values and starts watching persistDir, if asked to.
+void start_loading(const char *persistDir, ServerOptions server_options) {
+    flush();  // a previous server may still be writing to persistDir
+
+    std::unique_ptr<PersistBackend> backend;
+    if (persistDir) {
+        fs::create_directories(persistDir);
+        if (server_options & ServerOptions::PersistMmap)
+            backend = make_unique<MmapPersist>(persistDir);
+        else
+            backend = make_unique<JournalPersist>(persistDir);
+    }
+
+    std::vector<ConfigProperty *> loaded;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    if (!g_watchers)
+        g_watchers = make_unique<Watchers>();
+    g_persist.reset();
+    // imports pending keys without loading them one by one, as all keys are
+    // loaded below
+    import_definitions();
+    g_persist_max_record = persistDir &&
+        (server_options & ServerOptions::PersistMmap) ?
+        MmapPersist::kMaxRecordData : 0;
+    if (backend) {
+        g_persist = std::make_shared<PersistWriter>(
+            std::move(backend), g_persist_interval);
+    }
+    if (g_persist)
+        loaded = loadPersist(config_properties().sorted());
+    size_t keys = config_properties().size();
+    publish_snapshot();
+    lock.unlock();
+
+    // not one line per key, which GET lists anyway
+    logger()->info("current configuration has {} keys", keys);
+
+    for (auto cp : loaded)
+        notify(*cp);
+
+    g_dir_watcher.reset();
+    if (persistDir && (server_options & ServerOptions::WatchPersistDir)) {
+        std::string dir = persistDir;
+        g_dir_watcher = make_unique<DirWatcher>(dir, is_key_file,
+            [dir](const std::vector<std::string> &names) {
+                reload_key_files(dir, names);
+            });
+        logger()->info("watching {} for key files", dir);
+        // then catches up with files written while not watching, e.g.,
+        // while the process was down, which may be newer than persisted
+        reload_key_files(dir, key_files(dir));
+    }
+}
+
+// Serves REST and metrics. Throws if the port cannot be bound.
+void start_listening(int port, const char *basepath) {
+    auto uri = uri_builder()
+        .set_scheme("http")
+        .set_host("localhost")
+        .set_port(port)
+        .set_path(basepath)
         .to_uri();
 
     // should close previous listener
     g_listener = make_unique<http_listener>(uri);
-    g_listener->support(methods::GET, handle_get);
-    g_listener->support(methods::PUT, handle_put);
+    g_listener->support(methods::GET, counted(handle_get));
+    g_listener->support(methods::PUT, counted(handle_put));
+    g_listener->support(methods::POST, counted(handle_post));
+    g_listener->support(methods::PATCH, counted(handle_batch));
+
+    g_metrics_listener = make_unique<http_listener>(uri_builder(uri)
+        .set_path("/metrics")
+        .to_uri());
+    g_metrics_listener->support(methods::GET, handle_metrics);
+
+    (*g_listener).open().wait();
+    logger()->info("listening on {}", g_listener->uri().to_string());
+    (*g_metrics_listener).open().wait();
+    logger()->info("serving metrics on {}",
+        g_metrics_listener->uri().to_string());
+}
+
+// Routes requests received on a Unix domain socket the same as g_listener
+// and g_metrics_listener route those received over TCP.
+UnixServer::Handler unix_dispatcher(const std::string &basepath) {
+    auto get = counted(handle_get);
+    auto put = counted(handle_put);
+    auto post = counted(handle_post);
+    auto patch = counted(handle_batch);
+    return [basepath, get, put, post, patch](http_request request) {
+        const std::string path = request.request_uri().path();
+        const method &m = request.method();
+        if (path == "/metrics") {
+            if (m == methods::GET)
+                handle_metrics(request);
+            else
+                request.reply(status_codes::MethodNotAllowed);
+            return;
+        }
+        if (path.compare(0, basepath.size(), basepath) != 0 ||
+                (path.size() > basepath.size() &&
+                    path[basepath.size()] != '/')) {
+            request.reply(status_codes::NotFound);
+            return;
+        }
+
+        set_listener_path(&request, basepath);
+        if (m == methods::GET)
+            get(request);
+        else if (m == methods::PUT)
+            put(request);
+        else if (m == methods::POST)
+            post(request);
+        else if (m == methods::PATCH)
+            patch(request);
+        else
+            request.reply(status_codes::MethodNotAllowed);
+    };
+}
+
+std::unique_ptr<UnixServer> g_unix_server;
 
+void start_unix_server(const char *path, const char *basepath, int mode) {
+    g_unix_server.reset();
+    g_unix_server = make_unique<UnixServer>(path, mode,
+        unix_dispatcher(basepath));
+    logger()->info("listening on {}", path);
+}
+
+void stop_unix_server() {
+    g_unix_server.reset();
+}
+
+void start_server(
+    int port,
+    const char *basepath,
+    const char *persistDir,
+    ServerOptions server_options
+) {
+    start_loading(persistDir, server_options);
     try {
-        (*g_listener).open().wait();
-        logger()->info("listening on {}", g_listener->uri().to_string());
+        start_listening(port, basepath);
     } catch (std::exception const &e) {
         logger()->warn("Exception {}", e.what());
     }
 }
 
+std::future<void> start_server_async(
+    int port,
+    const char *basepath,
+    const char *persistDir,
+    ServerOptions server_options
+) {
+    // copied, since the caller's strings may be gone by then
+    std::string path = basepath;
+    bool persist = persistDir != NULL;
+    std::string dir = persist ? persistDir : "";
+    return std::async(std::launch::async,
+        [port, path, persist, dir, server_options]() {
+            start_loading(persist ? dir.c_str() : NULL, server_options);
+            start_listening(port, path.c_str());
+        });
+}
+
 void stop_server() {
-    logger()->info("stopped");
+    std::unique_ptr<Watchers> watchers;
+    std::unique_lock<std::mutex> lock(registry_mutex());
+    watchers.swap(g_watchers);
+    lock.unlock();
+    watchers.reset();  // answers pending watchers
+
     g_listener.reset();
+    g_metrics_listener.reset();
+    g_dir_watcher.reset();
+    flush();
+    logger()->info("stopped");
 }
 
 }  // namespace cpprestconfig
@@ -0,0 +1,534 @@
+// Copyright 2019 Cristian Klein
+#include "cpprestconfig/cpprestconfig.h"
+
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include "benchmark/benchmark.h"
+#include "cpprest/http_client.h"
+#include "cpprest/json.h"
+#include "src/key_index.h"
+#include "src/persist.h"
+
+static const bool &bench_flag_ref = cpprestconfig::config(
+    true,
+    "bench.flag_ref",
+    "Flag read through a reference",
+    "Used by the read benchmarks");
+
+static cpprestconfig::handle<bool> bench_flag_handle = cpprestconfig::config(
+    true,
+    "bench.flag_handle",
+    "Flag read through a handle",
+    "Used by the read benchmarks");
+
+static void BM_ReadReference(benchmark::State &state) {  // NOLINT
+    for (auto _ : state) {
+        bool value = bench_flag_ref;
+        benchmark::DoNotOptimize(value);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_ReadReference)->ThreadRange(1, 8);
+
+static void BM_ReadHandle(benchmark::State &state) {  // NOLINT
+    for (auto _ : state) {
+        bool value = bench_flag_handle.get();
+        benchmark::DoNotOptimize(value);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_ReadHandle)->ThreadRange(1, 8);
+
+static cpprestconfig::handle<cpprestconfig::rollout> bench_rollout =
+    cpprestconfig::config(
+        cpprestconfig::rollout{5},
+        "bench.rollout",
+        "Rollout checked per request",
+        "Used by the read benchmarks");
+
+static void BM_RolloutEnabledFor(benchmark::State &state) {  // NOLINT
+    uint64_t id = 0;
+    for (auto _ : state) {
+        bool value = bench_rollout.enabled_for(id++);
+        benchmark::DoNotOptimize(value);
+    }
+}
+BENCHMARK(BM_RolloutEnabledFor)->ThreadRange(1, 8);
+
+// Mimics the layout used before values moved to an arena: the value sits
+// next to its metadata, inside the node of a std::map.
+struct LegacyProperty {
+    std::string key, short_desc, long_desc;
+    bool value;
+    std::function<void(const char *, bool)> callback;
+};
+
+static std::vector<const bool *> legacy_flags(int n) {
+    static std::map<std::string, LegacyProperty> properties;
+    std::vector<const bool *> flags;
+    for (int i = 0; i < n; i++) {
+        std::string key = "bench.legacy." + std::to_string(i);
+        LegacyProperty &p = properties[key];
+        p.key = key;
+        p.short_desc = "Legacy flag";
+        p.long_desc = "Used by the layout benchmarks";
+        p.value = (i % 2 == 0);
+        flags.push_back(&p.value);
+    }
+    return flags;
+}
+
+static std::vector<cpprestconfig::handle<bool>> arena_flags(int n) {
+    std::vector<cpprestconfig::handle<bool>> flags;
+    for (int i = 0; i < n; i++) {
+        std::string key = "bench.arena." + std::to_string(i);
+        flags.push_back(cpprestconfig::config(
+            i % 2 == 0,
+            key.c_str(),
+            "Arena flag",
+            "Used by the layout benchmarks"));
+    }
+    return flags;
+}
+
+static void BM_ReadManyLegacyLayout(benchmark::State &state) {  // NOLINT
+    static std::vector<const bool *> flags;
+    int n = state.range(0);
+    if (state.thread_index() == 0 && static_cast<int>(flags.size()) < n)
+        flags = legacy_flags(n);
+    for (auto _ : state) {
+        int count = 0;
+        for (int i = 0; i < n; i++)
+            count += *flags[i];
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_ReadManyLegacyLayout)->Arg(16)->Arg(1024)->ThreadRange(1, 16);
+
+static void BM_ReadManyArena(benchmark::State &state) {  // NOLINT
+    static std::vector<cpprestconfig::handle<bool>> flags;
+    int n = state.range(0);
+    if (state.thread_index() == 0 && static_cast<int>(flags.size()) < n)
+        flags = arena_flags(n);
+    for (auto _ : state) {
+        int count = 0;
+        for (int i = 0; i < n; i++)
+            count += flags[i].get();
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_ReadManyArena)->Arg(16)->Arg(1024)->ThreadRange(1, 16);
+
+static std::vector<std::string> put_keys(int n) {
+    std::vector<std::string> keys;
+    for (int i = 0; i < n; i++) {
+        keys.push_back("bench.put." + std::to_string(i));
+        cpprestconfig::config(
+            0,
+            keys.back().c_str(),
+            "Changed over HTTP",
+            "Used by the PUT benchmarks");
+    }
+    return keys;
+}
+
+static void BM_SinglePuts(benchmark::State &state) {  // NOLINT
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto keys = put_keys(state.range(0));
+    cpprestconfig::start_server(8090);
+    http_client client(U("http://127.0.0.1:8090/api/config"));
+
+    int value = 0;
+    for (auto _ : state) {
+        value++;
+        for (auto const &key : keys) {
+            client.request(methods::PUT, key, std::to_string(value)).get();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+
+    cpprestconfig::stop_server();
+}
+BENCHMARK(BM_SinglePuts)->Arg(1)->Arg(50)->UseRealTime();
+
+static void BM_BatchPut(benchmark::State &state) {  // NOLINT
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto keys = put_keys(state.range(0));
+    cpprestconfig::start_server(8090);
+    http_client client(U("http://127.0.0.1:8090/api/config"));
+
+    int value = 0;
+    for (auto _ : state) {
+        value++;
+        auto changes = json::value::object();
+        for (auto const &key : keys) {
+            changes[key] = json::value(value);
+        }
+        client.request(methods::POST, "", changes).get();
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+
+    cpprestconfig::stop_server();
+}
+BENCHMARK(BM_BatchPut)->Arg(1)->Arg(50)->UseRealTime();
+
+// Monitoring scrapes the full listing; it is only rendered again after
+// a change.
+static void BM_GetListing(benchmark::State &state) {  // NOLINT
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto keys = put_keys(state.range(0));
+    cpprestconfig::start_server(8090);
+    http_client client(U("http://127.0.0.1:8090/api/config"));
+
+    for (auto _ : state) {
+        auto response = client.request(methods::GET).get();
+        benchmark::DoNotOptimize(response.extract_string().get());
+    }
+
+    cpprestconfig::stop_server();
+}
+BENCHMARK(BM_GetListing)->Arg(1000)->Arg(10000)->Arg(100000)->UseRealTime();
+
+// Filtered listings are rendered on every request, hence this measures
+// serializing all keys.
+static void BM_GetListingRendered(benchmark::State &state) {  // NOLINT
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto keys = put_keys(state.range(0));
+    cpprestconfig::start_server(8090);
+    http_client client(U("http://127.0.0.1:8090/api/config"));
+
+    for (auto _ : state) {
+        auto response = client.request(methods::GET, "?prefix=bench.").get();
+        benchmark::DoNotOptimize(response.extract_string().get());
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+
+    cpprestconfig::stop_server();
+}
+BENCHMARK(BM_GetListingRendered)->Arg(1000)->Arg(10000)->Arg(100000)
+    ->UseRealTime()->Unit(benchmark::kMillisecond);
+
+static void BM_GetListingNotModified(benchmark::State &state) {  // NOLINT
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto keys = put_keys(state.range(0));
+    cpprestconfig::start_server(8090);
+    http_client client(U("http://127.0.0.1:8090/api/config"));
+
+    std::string etag;
+    client.request(methods::GET).get().headers().match(
+        header_names::etag, etag);
+    for (auto _ : state) {
+        http_request request(methods::GET);
+        request.headers().add(header_names::if_none_match, etag);
+        benchmark::DoNotOptimize(client.request(request).get());
+    }
+
+    cpprestconfig::stop_server();
+}
+BENCHMARK(BM_GetListingNotModified)->Arg(1000)->Arg(10000)->Arg(100000)
+    ->UseRealTime();
+
+// Clones the configuration the JSON way: GET the listing, then PUT each
+// value back.
+static void BM_CloneJson(benchmark::State &state) {  // NOLINT
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto keys = put_keys(state.range(0));
+    cpprestconfig::start_server(8090);
+    http_client client(U("http://127.0.0.1:8090/api/config"));
+
+    for (auto _ : state) {
+        auto listing = client.request(methods::GET,
+            "?prefix=bench.put.&fields=value").get().extract_json().get();
+        for (auto &field : listing.as_object()) {
+            client.request(methods::PUT, field.first,
+                field.second["value"].serialize()).get();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+
+    cpprestconfig::stop_server();
+}
+BENCHMARK(BM_CloneJson)->Arg(1000)->Arg(10000)
+    ->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Clones all values through GET and PUT <base>/_snapshot.
+static void BM_CloneSnapshot(benchmark::State &state) {  // NOLINT
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto keys = put_keys(state.range(0));
+    cpprestconfig::start_server(8090);
+    http_client client(U("http://127.0.0.1:8090/api/config"));
+
+    for (auto _ : state) {
+        auto snapshot = client.request(methods::GET, "_snapshot").get()
+            .extract_vector().get();
+        http_request request(methods::PUT);
+        request.set_request_uri(U("_snapshot"));
+        request.set_body(std::move(snapshot));
+        client.request(request).get();
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+
+    cpprestconfig::stop_server();
+}
+BENCHMARK(BM_CloneSnapshot)->Arg(1000)->Arg(10000)
+    ->UseRealTime()->Unit(benchmark::kMillisecond);
+
+static std::vector<std::string> startup_keys(int n) {
+    std::vector<std::string> keys;
+    for (int i = 0; i < n; i++)
+        keys.push_back("bench.startup." + std::to_string(i));
+    return keys;
+}
+
+// One file per key, as persisted by older versions.
+static void BM_StartupLegacyFiles(benchmark::State &state) {  // NOLINT
+    namespace fs = boost::filesystem;
+
+    auto keys = startup_keys(state.range(0));
+    fs::path dir = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(dir);
+    for (auto const &key : keys) {
+        std::ofstream ofs((dir / key).native());
+        ofs << key.size();
+    }
+
+    for (auto _ : state) {
+        int sum = 0;
+        for (auto const &key : keys) {
+            std::ifstream ifs((dir / key).native());
+            std::string value((std::istreambuf_iterator<char>(ifs)),
+                std::istreambuf_iterator<char>());
+            sum += std::stoi(value);
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    fs::remove_all(dir);
+}
+BENCHMARK(BM_StartupLegacyFiles)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+template<typename Persist>
+static void BM_StartupPersist(benchmark::State &state) {  // NOLINT
+    namespace fs = boost::filesystem;
+
+    auto keys = startup_keys(state.range(0));
+    fs::path dir = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(dir);
+    {
+        Persist persist(dir.native());
+        cpprestconfig::PersistValues values;
+        for (auto const &key : keys)
+            values.push_back(std::make_pair(key, std::to_string(key.size())));
+        persist.save(values);
+    }
+
+    for (auto _ : state) {
+        int sum = 0;
+        Persist persist(dir.native());
+        std::string value;
+        for (auto const &key : keys) {
+            if (persist.load(key, &value))
+                sum += std::stoi(value);
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    fs::remove_all(dir);
+}
+BENCHMARK_TEMPLATE(BM_StartupPersist, cpprestconfig::JournalPersist)
+    ->Arg(10000)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_StartupPersist, cpprestconfig::MmapPersist)
+    ->Arg(10000)->Unit(benchmark::kMillisecond);
+
+// Changing range(0) keys at once, as the persistence thread does after
+// a batch change.
+template<typename Persist>
+static void BM_SavePersist(benchmark::State &state) {  // NOLINT
+    namespace fs = boost::filesystem;
+
+    auto keys = startup_keys(state.range(0));
+    fs::path dir = fs::temp_directory_path() / fs::unique_path();
+    fs::create_directories(dir);
+
+    {
+        Persist persist(dir.native());
+        int value = 0;
+        for (auto _ : state) {
+            value++;
+            cpprestconfig::PersistValues values;
+            for (auto const &key : keys)
+                values.push_back(std::make_pair(key, std::to_string(value)));
+            persist.save(values);
+        }
+        state.SetItemsProcessed(state.iterations() * keys.size());
+    }
+
+    fs::remove_all(dir);
+}
+BENCHMARK_TEMPLATE(BM_SavePersist, cpprestconfig::JournalPersist)
+    ->Arg(1)->Arg(1000)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SavePersist, cpprestconfig::MmapPersist)
+    ->Arg(1)->Arg(1000)->UseRealTime();
+
+static std::vector<std::string> declared_keys(const char *prefix, int n) {
+    static int round = 0;  // keys cannot be unregistered
+    round++;
+
+    std::vector<std::string> keys;
+    for (int i = 0; i < n; i++) {
+        keys.push_back(prefix + std::to_string(round) + "." +
+            std::to_string(i));
+    }
+    return keys;
+}
+
+// Keys registered by calling config() from static initializers
+static void BM_StartupConfig(benchmark::State &state) {  // NOLINT
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto keys = declared_keys("bench.config", state.range(0));
+        state.ResumeTiming();
+
+        for (auto const &key : keys) {
+            cpprestconfig::config(
+                0,
+                key.c_str(),
+                "Registered at startup",
+                "Used by the startup benchmarks");
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StartupConfig)->Arg(10000)->Iterations(5)
+    ->Unit(benchmark::kMillisecond);
+
+// Keys declared with CPPRESTCONFIG_DEFINE: static initialization only
+// enlists them, the registry imports them when first used.
+static void BM_StartupDefine(benchmark::State &state) {  // NOLINT
+    for (auto _ : state) {
+        state.PauseTiming();
+        // never freed, as the registry keeps pointing to them
+        auto keys = new std::vector<std::string>(
+            declared_keys("bench.define", state.range(0)));
+        auto definitions = new std::vector<cpprestconfig::definition<int>>();
+        for (auto const &key : *keys) {
+            definitions->push_back(cpprestconfig::definition<int>{
+                0,
+                key.c_str(),
+                cpprestconfig::key_hash(key.c_str()),
+                "Registered at startup",
+                "Used by the startup benchmarks",
+                {},
+                cpprestconfig::Default});
+        }
+        auto declared = new std::deque<cpprestconfig::defined<int>>();
+        for (auto const &d : *definitions)
+            declared->emplace_back(&d);
+        state.ResumeTiming();
+
+        for (auto &d : *declared)
+            d.enlist();
+
+        if (!state.range(1))
+            state.PauseTiming();
+        cpprestconfig::handle<int> h = declared->back();  // i.e., import
+        benchmark::DoNotOptimize(h);
+        if (!state.range(1))
+            state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_StartupDefine)->Args({10000, 0})->Args({10000, 1})->Iterations(5)
+    ->Unit(benchmark::kMillisecond);
+
+static std::vector<std::string> index_keys(int n) {
+    std::vector<std::string> keys;
+    for (int i = 0; i < n; i++)
+        keys.push_back("bench.module" + std::to_string(i % 97) +
+            ".key" + std::to_string(i));
+    return keys;
+}
+
+static void BM_RegisterMap(benchmark::State &state) {  // NOLINT
+    auto keys = index_keys(state.range(0));
+    for (auto _ : state) {
+        std::map<std::string, size_t> index;
+        for (auto const &key : keys)
+            index.insert(std::make_pair(key, index.size()));
+        benchmark::DoNotOptimize(index);
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_RegisterMap)->Arg(100)->Arg(10000)->Arg(100000);
+
+static void BM_RegisterKeyIndex(benchmark::State &state) {  // NOLINT
+    auto keys = index_keys(state.range(0));
+    for (auto _ : state) {
+        cpprestconfig::KeyIndex index;
+        for (auto const &key : keys)
+            index.insert(key);
+        benchmark::DoNotOptimize(index);
+    }
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_RegisterKeyIndex)->Arg(100)->Arg(10000)->Arg(100000);
+
+static void BM_LookupMap(benchmark::State &state) {  // NOLINT
+    auto keys = index_keys(state.range(0));
+    std::map<std::string, size_t> index;
+    for (auto const &key : keys)
+        index.insert(std::make_pair(key, index.size()));
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(index.find(keys[i]));
+        i = (i + 7919) % keys.size();
+    }
+}
+BENCHMARK(BM_LookupMap)->Arg(100)->Arg(10000)->Arg(100000);
+
+static void BM_LookupKeyIndex(benchmark::State &state) {  // NOLINT
+    auto keys = index_keys(state.range(0));
+    cpprestconfig::KeyIndex index;
+    for (auto const &key : keys)
+        index.insert(key);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(index.find(keys[i]));
+        i = (i + 7919) % keys.size();
+    }
+}
+BENCHMARK(BM_LookupKeyIndex)->Arg(100)->Arg(10000)->Arg(100000);
+
+BENCHMARK_MAIN();
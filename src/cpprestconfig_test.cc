@@ -1,7 +1,20 @@
 // Copyright 2019 Cristian Klein
 #include "cpprestconfig/cpprestconfig.h"
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <thread>
 
 #include <boost/filesystem.hpp>
 
@@ -24,6 +37,13 @@ const bool &show_cool_stuff = cpprestconfig::config(
     "Show something cool",
     "Enable this option to display something cool in the video output");
 
+// declared keys are readable before being imported into the registry
+CPPRESTCONFIG_DEFINE(int, declared_value, 3, "main.declared_value",
+    "Show something cool",
+    "Used by declared keys test",
+    {0, 100, 1});
+const int declared_value_early = declared_value.get();
+
 TEST(CppRestConfigTest, StaticInitializationIsSetToDefault) {
     EXPECT_FALSE(show_fps);
     EXPECT_TRUE(show_cool_stuff);
@@ -60,6 +80,203 @@ TEST(CppRestConfigTest, ListAllConfigurationValues) {
     cpprestconfig::stop_server();
 }
 
+TEST(CppRestConfigTest, ListingIsCachedWithETag) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    cpprestconfig::config(
+        false,
+        "main.show_etag",
+        "Show a lorem ipsum message",
+        "This option is really useless, but you can enable it anyway for fun");
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(methods::GET).get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    std::string etag;
+    EXPECT_TRUE(response.headers().match(header_names::etag, etag));
+
+    http_request unchanged(methods::GET);
+    unchanged.headers().add(header_names::if_none_match, etag);
+    response = client.request(unchanged).get();
+    EXPECT_EQ(response.status_code(), status_codes::NotModified);
+
+    response = client.request(
+        methods::PUT,
+        "main.show_etag",
+        "true").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    http_request changed(methods::GET);
+    changed.headers().add(header_names::if_none_match, etag);
+    response = client.request(changed).get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    auto body = response.extract_json().get();
+    EXPECT_EQ(body["main.show_etag"]["value"].as_bool(), true);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, GetSingleKeyAndPrefix) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    cpprestconfig::config(
+        3,
+        "filter.width",
+        "Width of the lorem ipsum",
+        "This option is really useless, but you can change it anyway for fun");
+    cpprestconfig::config(
+        4,
+        "filter.height",
+        "Height of the lorem ipsum",
+        "This option is really useless, but you can change it anyway for fun");
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(methods::GET, "filter.width").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    auto body = response.extract_json().get();
+    EXPECT_EQ(body["value"].as_integer(), 3);
+    EXPECT_EQ(body["type"].as_string(), "integer");
+
+    response = client.request(methods::GET, "filter.depth").get();
+    EXPECT_EQ(response.status_code(), status_codes::NotFound);
+
+    response = client.request(
+        methods::GET,
+        "?prefix=filter.&fields=value").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    body = response.extract_json().get();
+    EXPECT_EQ(body.size(), 2u);
+    EXPECT_EQ(body["filter.width"]["value"].as_integer(), 3);
+    EXPECT_EQ(body["filter.height"]["value"].as_integer(), 4);
+    EXPECT_FALSE(body["filter.height"].has_field("long_desc"));
+
+    response = client.request(methods::GET, "?fields=colour").get();
+    EXPECT_EQ(response.status_code(), status_codes::BadRequest);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, WatchChanges) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    cpprestconfig::config(
+        false,
+        "main.show_watched",
+        "Show a lorem ipsum message",
+        "This option is really useless, but you can enable it anyway for fun");
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(methods::GET, "watch").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    auto body = response.extract_json().get();
+    auto generation = body["generation"].as_number().to_uint64();
+    EXPECT_EQ(body["changes"]["main.show_watched"].as_bool(), false);
+
+    auto watch = client.request(
+        methods::GET,
+        "watch?timeout=10&since=" + std::to_string(generation));
+
+    response = client.request(
+        methods::PUT,
+        "main.show_watched",
+        "true").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    response = watch.get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    body = response.extract_json().get();
+    EXPECT_GT(body["generation"].as_number().to_uint64(), generation);
+    EXPECT_EQ(body["changes"].size(), 1u);
+    EXPECT_EQ(body["changes"]["main.show_watched"].as_bool(), true);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, ReadStats) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto counted = cpprestconfig::config(
+        3,
+        "main.counted_reads",
+        "Number of lorem ipsum messages",
+        "This option is really useless, but you can enable it anyway for fun");
+    for (int i = 0; i < 10; i++)
+        EXPECT_EQ(counted.get(), 3);
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(methods::GET, "_stats").get();
+#ifdef CPPRESTCONFIG_INSTRUMENT
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    auto body = response.extract_json().get();
+    EXPECT_EQ(body["main.counted_reads"]["reads"].as_integer(), 10);
+    EXPECT_FALSE(body["main.counted_reads"]["last_read"].is_null());
+#else
+    EXPECT_EQ(response.status_code(), status_codes::NotFound);
+#endif
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, ServerMetrics) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    cpprestconfig::config(
+        false,
+        "main.show_measured",
+        "Show a lorem ipsum message",
+        "This option is really useless, but you can enable it anyway for fun");
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088"));
+    auto response = client.request(
+        methods::PUT,
+        "api/config/main.show_measured",
+        "true").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    // requests are counted once replied, possibly after the client got the
+    // response
+    std::string body;
+    const std::string counted =
+        "cpprestconfig_requests_total{method=\"PUT\",code=\"200\"}";
+    for (int i = 0; i < 100 && body.find(counted) == std::string::npos; i++) {
+        if (i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        response = client.request(methods::GET, "metrics").get();
+        EXPECT_EQ(response.status_code(), status_codes::OK);
+        body = response.extract_string().get();
+    }
+    EXPECT_NE(body.find(counted), std::string::npos);
+    EXPECT_NE(body.find(
+        "cpprestconfig_stage_duration_seconds_count{stage=\"parse\"}"),
+        std::string::npos);
+    EXPECT_NE(body.find("cpprestconfig_keys "), std::string::npos);
+
+    cpprestconfig::stop_server();
+}
+
 TEST(CppRestConfigTest, ChangeInt) {
     using namespace web;  // NOLINT
     using namespace web::http;  // NOLINT
@@ -148,6 +365,52 @@ TEST(CppRestConfigTest, ChangeBoolWithCallback) {
     cpprestconfig::stop_server();
 }
 
+TEST(CppRestConfigTest, ChangeIntWithAsyncCallback) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    const char *key = "main.slow_callback";
+
+    std::atomic<int> callback_calls(0);
+    std::atomic<int> value_during_callback(0);
+
+    cpprestconfig::config<int>(
+        0,
+        key,
+        "Rebuild something slowly",
+        "This option is really useless, but you can change it anyway for fun",
+        [&callback_calls, &value_during_callback]
+        (const char *key, int value) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            value_during_callback = value;
+            callback_calls++;
+        },
+        {},
+        cpprestconfig::AsyncCallback);
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+
+    for (int i = 1; i <= 5; i++) {
+        auto response = client.request(
+            methods::PUT,
+            key,
+            std::to_string(i)).get();
+        EXPECT_EQ(response.status_code(), status_codes::OK);
+    }
+    EXPECT_LT(callback_calls, 5);  // i.e., PUT did not wait for callbacks
+
+    cpprestconfig::flush();
+    EXPECT_EQ(value_during_callback, 5);
+    EXPECT_GT(cpprestconfig::callback_metrics().coalesced, 0u);
+    EXPECT_EQ(cpprestconfig::callback_metrics().pending, 0u);
+
+    cpprestconfig::stop_server();
+}
+
 TEST(CppRestConfigTest, ChangeBool) {
     using namespace web;  // NOLINT
     using namespace web::http;  // NOLINT
@@ -190,171 +453,652 @@ TEST(CppRestConfigTest, ChangeBool) {
     cpprestconfig::stop_server();
 }
 
-TEST(CppRestConfigTest, ChangeIntWithRange) {
+TEST(CppRestConfigTest, ChangeBoolThroughHandle) {
     using namespace web;  // NOLINT
     using namespace web::http;  // NOLINT
     using namespace web::http::client;  // NOLINT
     using utility::conversions::to_string_t;
 
-    // of course, you can also use it in "normal" initialization context :)
-    const int &exposure = cpprestconfig::config(
-        1570,
-        "main.exposure",
-        "Set exposure",
-        "This option is really useless, but you can enable it anyway for fun",
-        {},  // no callback
-        { 100, 2810, 10 });
+    cpprestconfig::handle<bool> show_handle = cpprestconfig::config(
+        false,
+        "main.show_handle",
+        "Show a lorem ipsum message",
+        "This option is really useless, but you can enable it anyway for fun");
+    const bool &show_handle_ref = show_handle;
 
-    EXPECT_EQ(exposure, 1570);
+    EXPECT_FALSE(show_handle.get());
 
     cpprestconfig::start_server(8088);
 
     http_client client(U("http://127.0.0.1:8088/api/config"));
     auto response = client.request(
         methods::PUT,
-        "main.exposure",
-        "-15").get();
-    EXPECT_EQ(exposure, 100);
-    EXPECT_EQ(response.status_code(), status_codes::OK);
-
-    response = client.request(
-        methods::PUT,
-        "main.exposure",
-        "3000").get();
-    EXPECT_EQ(exposure, 2810);
-    EXPECT_EQ(response.status_code(), status_codes::OK);
-
-    response = client.request(
-        methods::PUT,
-        "main.exposure",
-        "1555").get();
-    EXPECT_EQ(exposure, 1550);
+        "main.show_handle",
+        "true").get();
+    EXPECT_TRUE(show_handle.get());
+    EXPECT_TRUE(show_handle_ref);
     EXPECT_EQ(response.status_code(), status_codes::OK);
 
     cpprestconfig::stop_server();
 }
 
-TEST(CppRestConfigTest, InvalidKey) {
+TEST(CppRestConfigTest, SnapshotIsConsistent) {
     using namespace web;  // NOLINT
     using namespace web::http;  // NOLINT
     using namespace web::http::client;  // NOLINT
     using utility::conversions::to_string_t;
 
+    auto width = cpprestconfig::config(
+        640,
+        "main.snapshot_width",
+        "Width",
+        "Used by snapshot test");
+    auto height = cpprestconfig::config(
+        480,
+        "main.snapshot_height",
+        "Height",
+        "Used by snapshot test");
+
     cpprestconfig::start_server(8088);
 
-    http_client client(U("http://127.0.0.1:8088/api/config"));
-    auto response = client.request(
-        methods::PUT,
-        "key_does_not_exist",
-        "true").get();
-    EXPECT_EQ(response.status_code(), status_codes::NotFound);
+    {
+        auto before = cpprestconfig::snapshot();
+        uint64_t generation = before.generation();
+
+        http_client client(U("http://127.0.0.1:8088/api/config"));
+        auto response = client.request(
+            methods::PUT,
+            "main.snapshot_width",
+            "1920").get();
+        EXPECT_EQ(response.status_code(), status_codes::OK);
+
+        // the old snapshot is immutable
+        EXPECT_EQ(before.get(width), 640);
+        EXPECT_EQ(before.get(height), 480);
+
+        auto after = cpprestconfig::snapshot();
+        EXPECT_GT(after.generation(), generation);
+        EXPECT_EQ(after.get(width), 1920);
+        EXPECT_EQ(after.get(height), 480);
+    }
 
     cpprestconfig::stop_server();
 }
 
-TEST(CppRestConfigTest, InvalidValue) {
+TEST(CppRestConfigTest, BatchChange) {
     using namespace web;  // NOLINT
     using namespace web::http;  // NOLINT
     using namespace web::http::client;  // NOLINT
     using utility::conversions::to_string_t;
 
+    auto a = cpprestconfig::config(
+        0,
+        "main.batch_a",
+        "First value",
+        "Used by batch test");
+    auto b = cpprestconfig::config(
+        false,
+        "main.batch_b",
+        "Second value",
+        "Used by batch test");
+
     cpprestconfig::start_server(8088);
 
     http_client client(U("http://127.0.0.1:8088/api/config"));
-    auto response = client.request(
-        methods::PUT,
-        "main.show_fps",
-        "weird_value").get();
+
+    auto changes = json::value::object();
+    changes["main.batch_a"] = json::value(42);
+    changes["main.batch_b"] = json::value::string("true");
+    auto response = client.request(methods::POST, "", changes).get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_EQ(a.get(), 42);
+    EXPECT_TRUE(b.get());
+
+    // nothing is applied if any value is invalid
+    changes["main.batch_a"] = json::value(43);
+    changes["main.batch_b"] = json::value::string("weird_value");
+    response = client.request(methods::POST, "", changes).get();
     EXPECT_EQ(response.status_code(), status_codes::BadRequest);
+    EXPECT_EQ(a.get(), 42);
+
+    changes = json::value::object();
+    changes["key_does_not_exist"] = json::value(1);
+    response = client.request(methods::PATCH, "", changes).get();
+    EXPECT_EQ(response.status_code(), status_codes::NotFound);
 
     cpprestconfig::stop_server();
 }
 
-TEST(CppRestConfigTest, PersistenceTest) {
+enum class LoremMode { Short, Long };
+
+TEST(CppRestConfigTest, ChangeOtherTypes) {
     using namespace web;  // NOLINT
     using namespace web::http;  // NOLINT
     using namespace web::http::client;  // NOLINT
     using utility::conversions::to_string_t;
 
-    namespace fs = boost::filesystem;
-
-    fs::path tmpDir = fs::unique_path();
+    auto endpoint = cpprestconfig::config<std::string>(
+        "http://localhost:1234",
+        "main.lorem_endpoint",
+        "Where to fetch lorem ipsum from",
+        "This option is really useless, but you can change it anyway for fun");
+    auto rate = cpprestconfig::config<double>(
+        0.5,
+        "main.lorem_rate",
+        "Fraction of lorem ipsum to show",
+        "This option is really useless, but you can change it anyway for fun",
+        {},
+        {0.0, 1.0, 0.0});
+    auto budget = cpprestconfig::config<int64_t>(
+        1LL << 40,
+        "main.lorem_budget",
+        "Bytes of lorem ipsum to show",
+        "This option is really useless, but you can change it anyway for fun");
+    auto mode = cpprestconfig::config(
+        LoremMode::Short,
+        "main.lorem_mode",
+        "How to show lorem ipsum",
+        "This option is really useless, but you can change it anyway for fun",
+        cpprestconfig::enum_names<LoremMode>{
+            {"short", LoremMode::Short},
+            {"long", LoremMode::Long},
+        });
 
-    int &value = cpprestconfig::config(
-        0,
-        "main.random_value",
-        "Show something cool",
-        "Used by persistence test");
-    int value_to_set_and_expect;
-    {
-        time_t t;
-        time(&t);
-        value_to_set_and_expect = t;
-    }
+    EXPECT_EQ(endpoint.get(), "http://localhost:1234");
+    EXPECT_EQ(mode.get(), LoremMode::Short);
 
-    cpprestconfig::start_server(8088,
-        "/api/config",
-        tmpDir.native().c_str());
+    cpprestconfig::start_server(8088);
 
     http_client client(U("http://127.0.0.1:8088/api/config"));
     auto response = client.request(
-        methods::PUT,
-        "main.random_value",
-        std::to_string(value_to_set_and_expect)).get();
+        methods::POST,
+        "",
+        json::value::parse(
+            "{\"main.lorem_endpoint\": \"http://localhost:5678\","
+            " \"main.lorem_rate\": 2.5,"
+            " \"main.lorem_budget\": 1099511627777,"
+            " \"main.lorem_mode\": \"long\"}")).get();
     EXPECT_EQ(response.status_code(), status_codes::OK);
 
-    cpprestconfig::stop_server();
+    EXPECT_EQ(endpoint.get(), "http://localhost:5678");
+    EXPECT_EQ(rate.get(), 1.0);  // i.e., limited
+    EXPECT_EQ(budget.get(), (1LL << 40) + 1);
+    EXPECT_EQ(mode.get(), LoremMode::Long);
 
-    value = 0;
-    EXPECT_NE(value, value_to_set_and_expect);
+    {
+        auto snapshot = cpprestconfig::snapshot();
+        EXPECT_EQ(snapshot.get(endpoint), "http://localhost:5678");
+        EXPECT_EQ(snapshot.get(mode), LoremMode::Long);
+    }
 
-    // start_server should reload from persistence
-    cpprestconfig::start_server(8088,
-        "/api/config",
-        tmpDir.native().c_str());
+    response = client.request(methods::GET, "main.lorem_mode").get();
+    auto body = response.extract_json().get();
+    EXPECT_EQ(body["type"].as_string(), "enum");
+    EXPECT_EQ(body["value"].as_string(), "long");
 
-    EXPECT_EQ(value, value_to_set_and_expect);
+    response = client.request(
+        methods::PUT,
+        "main.lorem_mode",
+        "medium").get();
+    EXPECT_EQ(response.status_code(), status_codes::BadRequest);
 
     cpprestconfig::stop_server();
 }
 
-TEST(CppRestConfigTest, NonPersistenceTest) {
+TEST(CppRestConfigTest, HistoryAndRollback) {
     using namespace web;  // NOLINT
     using namespace web::http;  // NOLINT
     using namespace web::http::client;  // NOLINT
-    using utility::conversions::to_string_t;
-
-    namespace fs = boost::filesystem;
 
-    fs::path tmpDir = fs::unique_path();
-
-    int &value = cpprestconfig::config(
-        0,
-        "main.random_value2",
-        "Show something cool",
-        "Used by persistence test",
-        {},
-        {},
-        cpprestconfig::Options::NoPersist);
-    int value_to_set_and_expect;
-    {
-        time_t t;
-        time(&t);
-        value_to_set_and_expect = t;
-    }
+    auto value = cpprestconfig::config(
+        1,
+        "main.rolled_back",
+        "Number of lorem ipsum messages",
+        "This option is really useless, but you can enable it anyway for fun");
 
-    cpprestconfig::start_server(8088,
-        "/api/config",
-        tmpDir.native().c_str());
+    cpprestconfig::start_server(8088);
 
     http_client client(U("http://127.0.0.1:8088/api/config"));
     auto response = client.request(
         methods::PUT,
-        "main.random_value2",
-        std::to_string(value_to_set_and_expect)).get();
+        "main.rolled_back",
+        "2").get();
     EXPECT_EQ(response.status_code(), status_codes::OK);
 
-    cpprestconfig::stop_server();
+    response = client.request(methods::GET, "_history").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    auto body = response.extract_json().get();
+    auto good = body["generation"].as_number().to_uint64();
+    auto changes = body["changes"];
+    ASSERT_GT(changes.size(), 0u);
+    auto last = changes[changes.size() - 1];
+    EXPECT_EQ(last["key"].as_string(), "main.rolled_back");
+    EXPECT_EQ(last["old_value"].as_string(), "1");
+    EXPECT_EQ(last["new_value"].as_string(), "2");
+    EXPECT_EQ(last["source"].as_string(), "put");
+
+    response = client.request(
+        methods::PUT,
+        "main.rolled_back",
+        "3").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_EQ(value.get(), 3);
+
+    response = client.request(
+        methods::POST,
+        "_rollback?to=" + std::to_string(good)).get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_GT(response.extract_json().get()["generation"].as_number()
+        .to_uint64(), good);
+    EXPECT_EQ(value.get(), 2);
+
+    response = client.request(
+        methods::POST,
+        "_rollback?to=" + std::to_string(good + 100)).get();
+    EXPECT_EQ(response.status_code(), status_codes::BadRequest);
+
+    cpprestconfig::stop_server();
+
+    // loading persisted values is not a change to roll back, and would
+    // push those out of the history
+    namespace fs = boost::filesystem;
+    fs::path tmpDir = fs::unique_path();
+    fs::create_directories(tmpDir);
+    {
+        std::ofstream ofs((tmpDir / "main.rolled_back").native());
+        ofs << "5";
+    }
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+    EXPECT_EQ(value.get(), 5);
+    response = client.request(methods::GET, "_history").get();
+    changes = response.extract_json().get()["changes"];
+    for (size_t i = 0; i < changes.size(); i++)
+        EXPECT_NE(changes[i]["source"].as_string(), "persist");
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, CloneSnapshot) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto value = cpprestconfig::config(
+        1,
+        "main.cloned_value",
+        "Number of lorem ipsum messages",
+        "This option is really useless, but you can enable it anyway for fun");
+    auto text = cpprestconfig::config<std::string>(
+        "lorem",
+        "main.cloned_text",
+        "Lorem ipsum message",
+        "This option is really useless, but you can change it anyway for fun");
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(methods::GET, "_snapshot").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    auto snapshot = response.extract_vector().get();
+    ASSERT_GT(snapshot.size(), 8u);
+
+    client.request(methods::PUT, "main.cloned_value", "2").get();
+    client.request(methods::PUT, "main.cloned_text", "ipsum").get();
+    EXPECT_EQ(value.get(), 2);
+
+    http_request request(methods::PUT);
+    request.set_request_uri(U("_snapshot"));
+    request.set_body(snapshot);
+    response = client.request(request).get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_EQ(value.get(), 1);
+    EXPECT_EQ(text.get(), "lorem");
+
+    // truncated snapshots change nothing
+    client.request(methods::PUT, "main.cloned_value", "2").get();
+    snapshot.pop_back();
+    request = http_request(methods::PUT);
+    request.set_request_uri(U("_snapshot"));
+    request.set_body(snapshot);
+    response = client.request(request).get();
+    EXPECT_EQ(response.status_code(), status_codes::BadRequest);
+    EXPECT_EQ(value.get(), 2);
+
+    // so do snapshots claiming more values than they could hold
+    snapshot.resize(24);
+    snapshot[12] = snapshot[13] = snapshot[14] = snapshot[15] = 0xff;
+    request = http_request(methods::PUT);
+    request.set_request_uri(U("_snapshot"));
+    request.set_body(snapshot);
+    response = client.request(request).get();
+    EXPECT_EQ(response.status_code(), status_codes::BadRequest);
+    EXPECT_EQ(value.get(), 2);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, ChangeRollout) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto rollout = cpprestconfig::config(
+        cpprestconfig::rollout{0},
+        "main.lorem_rollout",
+        "Share of users seeing lorem ipsum",
+        "This option is really useless, but you can ramp it up anyway for fun");
+
+    auto enabled = [&rollout]() {
+        int n = 0;
+        for (uint64_t user = 0; user < 10000; user++)
+            n += rollout.enabled_for(user);
+        return n;
+    };
+    EXPECT_EQ(enabled(), 0);
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.lorem_rollout",
+        "20").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_EQ(rollout.get().percent, 20);
+    EXPECT_NEAR(enabled(), 2000, 200);
+    std::vector<uint64_t> early;
+    for (uint64_t user = 0; user < 10000; user++)
+        if (rollout.enabled_for(user))
+            early.push_back(user);
+
+    response = client.request(
+        methods::PUT,
+        "main.lorem_rollout",
+        "50").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_NEAR(enabled(), 5000, 300);
+    for (auto user : early)
+        EXPECT_TRUE(rollout.enabled_for(user));  // ramping up only adds
+
+    response = client.request(
+        methods::PUT,
+        "main.lorem_rollout",
+        "150").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_EQ(rollout.get().percent, 100);
+    EXPECT_EQ(enabled(), 10000);
+
+    // would get past the limits, and enable no one or everyone
+    for (auto value : { "nan", "-nan", "inf", "-inf", "1e999", "0x20" }) {
+        response = client.request(
+            methods::PUT,
+            "main.lorem_rollout",
+            value).get();
+        EXPECT_EQ(response.status_code(), status_codes::BadRequest) << value;
+        EXPECT_EQ(rollout.get().percent, 100) << value;
+    }
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, ChangeIntWithRange) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    // of course, you can also use it in "normal" initialization context :)
+    const int &exposure = cpprestconfig::config(
+        1570,
+        "main.exposure",
+        "Set exposure",
+        "This option is really useless, but you can enable it anyway for fun",
+        {},  // no callback
+        { 100, 2810, 10 });
+
+    EXPECT_EQ(exposure, 1570);
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.exposure",
+        "-15").get();
+    EXPECT_EQ(exposure, 100);
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    response = client.request(
+        methods::PUT,
+        "main.exposure",
+        "3000").get();
+    EXPECT_EQ(exposure, 2810);
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    response = client.request(
+        methods::PUT,
+        "main.exposure",
+        "1555").get();
+    EXPECT_EQ(exposure, 1550);
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, InvalidKey) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "key_does_not_exist",
+        "true").get();
+    EXPECT_EQ(response.status_code(), status_codes::NotFound);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, InvalidValue) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.show_fps",
+        "weird_value").get();
+    EXPECT_EQ(response.status_code(), status_codes::BadRequest);
+
+    // whitespace is not trimmed, whatever the type
+    for (auto value : { "true ", " true", "true\n", "1x" }) {
+        response = client.request(
+            methods::PUT,
+            "main.show_fps",
+            value).get();
+        EXPECT_EQ(response.status_code(), status_codes::BadRequest) << value;
+    }
+
+    // only plain decimal numbers, which are finite
+    auto rate = cpprestconfig::config<double>(
+        0.5,
+        "main.invalid_rate",
+        "Fraction of invalid lorem ipsum to show",
+        "This option is really useless, but you can change it anyway for fun",
+        {},
+        {0.0, 1.0, 0.0});
+    for (auto value : { "nan", "-nan", "inf", "-inf", "infinity", "1e999",
+            "0x1p-1", " 0.25", "0,25", "." }) {
+        response = client.request(
+            methods::PUT,
+            "main.invalid_rate",
+            value).get();
+        EXPECT_EQ(response.status_code(), status_codes::BadRequest) << value;
+    }
+    EXPECT_EQ(rate.get(), 0.5);
+    for (auto value : { "0.25", ".25", "+2.5e-1", "25E-2" }) {
+        response = client.request(
+            methods::PUT,
+            "main.invalid_rate",
+            value).get();
+        EXPECT_EQ(response.status_code(), status_codes::OK) << value;
+        EXPECT_EQ(rate.get(), 0.25) << value;
+    }
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, PersistenceTest) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    namespace fs = boost::filesystem;
+
+    fs::path tmpDir = fs::unique_path();
+
+    int &value = cpprestconfig::config(
+        0,
+        "main.random_value",
+        "Show something cool",
+        "Used by persistence test");
+    int value_to_set_and_expect;
+    {
+        time_t t;
+        time(&t);
+        value_to_set_and_expect = t;
+    }
+
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.random_value",
+        std::to_string(value_to_set_and_expect)).get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    cpprestconfig::stop_server();
+
+    value = 0;
+    EXPECT_NE(value, value_to_set_and_expect);
+
+    // start_server should reload from persistence
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+
+    EXPECT_EQ(value, value_to_set_and_expect);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, MmapPersistenceTest) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    namespace fs = boost::filesystem;
+
+    fs::path tmpDir = fs::unique_path();
+
+    auto value = cpprestconfig::config(
+        0,
+        "main.random_value_mmap",
+        "Show something cool",
+        "Used by persistence test");
+    auto text = cpprestconfig::config<std::string>(
+        "lorem",
+        "main.random_text_mmap",
+        "Show something cool",
+        "Used by persistence test");
+
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str(),
+        cpprestconfig::ServerOptions::PersistMmap);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.random_value_mmap",
+        "4242").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    // too long to be persisted in a record
+    response = client.request(
+        methods::PUT,
+        "main.random_text_mmap",
+        std::string(200, 'x')).get();
+    EXPECT_EQ(response.status_code(), status_codes::BadRequest);
+    EXPECT_EQ(text.get(), "lorem");
+
+    cpprestconfig::stop_server();
+
+    static_cast<int &>(value) = 0;
+
+    // start_server should reload from persistence
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str(),
+        cpprestconfig::ServerOptions::PersistMmap);
+
+    EXPECT_EQ(value.get(), 4242);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, NonPersistenceTest) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    namespace fs = boost::filesystem;
+
+    fs::path tmpDir = fs::unique_path();
+
+    int &value = cpprestconfig::config(
+        0,
+        "main.random_value2",
+        "Show something cool",
+        "Used by persistence test",
+        {},
+        {},
+        cpprestconfig::Options::NoPersist);
+    int value_to_set_and_expect;
+    {
+        time_t t;
+        time(&t);
+        value_to_set_and_expect = t;
+    }
+
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.random_value2",
+        std::to_string(value_to_set_and_expect)).get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    cpprestconfig::stop_server();
 
     value = 0;
     EXPECT_NE(value, value_to_set_and_expect);
@@ -368,3 +1112,395 @@ TEST(CppRestConfigTest, NonPersistenceTest) {
 
     cpprestconfig::stop_server();
 }
+
+TEST(CppRestConfigTest, ImportLegacyPersistence) {
+    namespace fs = boost::filesystem;
+
+    fs::path tmpDir = fs::unique_path();
+    fs::create_directories(tmpDir);
+    {
+        // older versions stored one file per key
+        std::ofstream ofs((tmpDir / "main.legacy_value").native());
+        ofs << "17";
+    }
+
+    auto value = cpprestconfig::config(
+        0,
+        "main.legacy_value",
+        "Show something cool",
+        "Used by persistence test");
+
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+
+    EXPECT_EQ(value.get(), 17);
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, StopServerDrainsPersistence) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using utility::conversions::to_string_t;
+
+    namespace fs = boost::filesystem;
+
+    fs::path tmpDir = fs::unique_path();
+
+    auto value = cpprestconfig::config(
+        0,
+        "main.random_value_drained",
+        "Show something cool",
+        "Used by persistence test");
+
+    // much longer than the test itself
+    cpprestconfig::set_persist_interval(60 * 60 * 1000);
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    for (int i = 1; i <= 10; i++) {
+        auto response = client.request(
+            methods::PUT,
+            "main.random_value_drained",
+            std::to_string(i)).get();
+        EXPECT_EQ(response.status_code(), status_codes::OK);
+    }
+
+    cpprestconfig::stop_server();
+    cpprestconfig::set_persist_interval(100);
+
+    static_cast<int &>(value) = 0;
+
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+
+    EXPECT_EQ(value.get(), 10);
+
+    cpprestconfig::stop_server();
+}
+
+// Records how long starting takes, e.g., in the XML output of
+// --gtest_output, both when waiting for the server and when not.
+TEST(CppRestConfigTest, StartServerAsync) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+    using std::chrono::steady_clock;
+    using std::chrono::microseconds;
+    using std::chrono::duration_cast;
+
+    namespace fs = boost::filesystem;
+
+    fs::path tmpDir = fs::unique_path();
+
+    std::vector<cpprestconfig::handle<int>> values;
+    for (int i = 0; i < 1000; i++) {
+        std::string key = "main.startup." + std::to_string(i);
+        values.push_back(cpprestconfig::config(
+            0,
+            key.c_str(),
+            "Show something cool",
+            "Used by startup test"));
+    }
+
+    auto start = steady_clock::now();
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+    auto sync_started = steady_clock::now();
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.startup.7",
+        "7").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    cpprestconfig::stop_server();
+
+    static_cast<int &>(values[7]) = 0;
+
+    auto async_start = steady_clock::now();
+    auto ready = cpprestconfig::start_server_async(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+    auto async_returned = steady_clock::now();
+    ready.get();
+    auto async_ready = steady_clock::now();
+
+    EXPECT_EQ(values[7].get(), 7);
+    response = client.request(methods::GET, "main.startup.7").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+
+    auto us = [](steady_clock::duration d) {
+        return static_cast<int>(duration_cast<microseconds>(d).count());
+    };
+    RecordProperty("sync_startup_us", us(sync_started - start));
+    RecordProperty("async_return_us", us(async_returned - async_start));
+    RecordProperty("async_ready_us", us(async_ready - async_start));
+
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, WatchPersistDir) {
+    namespace fs = boost::filesystem;
+
+    fs::path tmpDir = fs::unique_path();
+
+    auto value = cpprestconfig::config<int>(
+        0,
+        "main.watched_value",
+        "Show something cool",
+        "Used by watch test",
+        nullptr,
+        {0, 100, 1});
+
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str(),
+        cpprestconfig::ServerOptions::WatchPersistDir);
+
+    {
+        std::ofstream ofs((tmpDir / "main.watched_value").native());
+        ofs << "42\n";
+    }
+    for (int i = 0; i < 200 && value.get() != 42; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(value.get(), 42);
+
+    // limits apply as for changes over REST
+    {
+        std::ofstream ofs((tmpDir / "main.watched_value").native());
+        ofs << "1000";
+    }
+    for (int i = 0; i < 200 && value.get() != 100; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(value.get(), 100);
+
+    cpprestconfig::stop_server();
+
+    // and the reloaded value is persisted
+    static_cast<int &>(value) = 0;
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+    EXPECT_EQ(value.get(), 100);
+    cpprestconfig::stop_server();
+
+    // files written while not watching are newer than the journal
+    {
+        std::ofstream ofs((tmpDir / "main.watched_value").native());
+        ofs << "7\n";
+    }
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str(),
+        cpprestconfig::ServerOptions::WatchPersistDir);
+    EXPECT_EQ(value.get(), 7);
+    cpprestconfig::stop_server();
+
+    // legacy files are imported the same, e.g., as written by echo
+    fs::path legacyDir = fs::unique_path();
+    fs::create_directories(legacyDir);
+    {
+        std::ofstream ofs((legacyDir / "main.watched_value").native());
+        ofs << "33\n";
+    }
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        legacyDir.native().c_str());
+    EXPECT_EQ(value.get(), 33);
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, DeclaredKeys) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    namespace fs = boost::filesystem;
+
+    EXPECT_EQ(declared_value_early, 3);
+
+    // loaded from persistDir, and published
+    fs::path tmpDir = fs::unique_path();
+    fs::create_directories(tmpDir);
+    {
+        std::ofstream ofs((tmpDir / "main.declared_value").native());
+        ofs << "17";
+    }
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+    EXPECT_EQ(declared_value.get(), 17);
+    {
+        auto snapshot = cpprestconfig::snapshot();
+        EXPECT_EQ(snapshot.get(declared_value), 17);
+    }
+
+    // changed over REST, as any other key, limits included
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.declared_value",
+        "1000").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_EQ(declared_value.get(), 100);
+    {
+        auto snapshot = cpprestconfig::snapshot();
+        EXPECT_EQ(snapshot.get(declared_value), 100);
+    }
+
+    response = client.request(
+        methods::PUT,
+        "main.declared_value",
+        "42").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    cpprestconfig::stop_server();
+
+    // and reloaded from the journal it was persisted to, after another
+    // directory loaded another value
+    fs::path otherDir = fs::unique_path();
+    fs::create_directories(otherDir);
+    {
+        std::ofstream ofs((otherDir / "main.declared_value").native());
+        ofs << "9";
+    }
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        otherDir.native().c_str());
+    EXPECT_EQ(declared_value.get(), 9);
+    cpprestconfig::stop_server();
+
+    cpprestconfig::start_server(8088,
+        "/api/config",
+        tmpDir.native().c_str());
+    EXPECT_EQ(declared_value.get(), 42);
+    cpprestconfig::stop_server();
+}
+
+TEST(CppRestConfigTest, UnixSocketServer) {
+    auto value = cpprestconfig::config(
+        0,
+        "main.unix_value",
+        "Show something cool",
+        "Used by Unix domain socket test");
+
+    std::string path = (boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path()).native();
+    cpprestconfig::start_unix_server(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+        sizeof(addr)), 0);
+
+    // both requests on the same connection
+    std::string requests =
+        "PUT /api/config/main.unix_value HTTP/1.1\r\n"
+        "Content-Length: 2\r\n"
+        "\r\n"
+        "42"
+        "GET /api/config/main.unix_value?fields=value HTTP/1.1\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+    ASSERT_EQ(write(fd, requests.data(), requests.size()),
+        static_cast<ssize_t>(requests.size()));
+    std::string responses;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        responses.append(buf, n);
+    close(fd);
+
+    EXPECT_EQ(value.get(), 42);
+    EXPECT_EQ(responses.find("HTTP/1.1 200"), 0u);
+    size_t second = responses.find("HTTP/1.1 200", 1);
+    EXPECT_NE(second, std::string::npos);
+    EXPECT_NE(responses.find("{\"value\":42}", second), std::string::npos);
+
+    cpprestconfig::stop_unix_server();
+    EXPECT_FALSE(boost::filesystem::exists(path));
+}
+
+TEST(CppRestConfigTest, FollowSharedValues) {
+    using namespace web;  // NOLINT
+    using namespace web::http;  // NOLINT
+    using namespace web::http::client;  // NOLINT
+
+    auto value = cpprestconfig::config(
+        0,
+        "main.shared_value",
+        "Show something cool",
+        "Used by shared values test");
+
+    // the follower is this test, run by a child process
+    const char *follow = getenv("CPPRESTCONFIG_TEST_FOLLOW");
+    if (follow) {
+        cpprestconfig::start_following(follow);
+        for (int i = 0; i < 500 && value.get() != 7; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_EQ(value.get(), 7);
+
+        // keys registered later, e.g., by modules loaded lazily, still get
+        // the shared value, not only its next change
+        auto late = cpprestconfig::config(
+            0,
+            "main.late_shared_value",
+            "Show something cool",
+            "Used by shared values test");
+        for (int i = 0; i < 500 && late.get() != 9; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        EXPECT_EQ(late.get(), 9);
+        cpprestconfig::stop_following();
+        return;
+    }
+
+    auto late = cpprestconfig::config(
+        0,
+        "main.late_shared_value",
+        "Show something cool",
+        "Used by shared values test");
+
+    std::string name = "/cpprestconfig-test-" + std::to_string(getpid());
+    cpprestconfig::start_sharing(name.c_str());
+    cpprestconfig::start_server(8088);
+
+    http_client client(U("http://127.0.0.1:8088/api/config"));
+    auto response = client.request(
+        methods::PUT,
+        "main.shared_value",
+        "7").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    response = client.request(
+        methods::PUT,
+        "main.late_shared_value",
+        "9").get();
+    EXPECT_EQ(response.status_code(), status_codes::OK);
+    EXPECT_EQ(late.get(), 9);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("CPPRESTCONFIG_TEST_FOLLOW", name.c_str(), 1);
+        execl("/proc/self/exe", "/proc/self/exe",
+            "--gtest_filter=CppRestConfigTest.FollowSharedValues",
+            static_cast<char *>(NULL));
+        _exit(127);
+    }
+    ASSERT_GT(pid, 0);
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+
+    cpprestconfig::stop_server();
+    cpprestconfig::stop_sharing();
+    EXPECT_LT(shm_open(name.c_str(), O_RDONLY, 0), 0);  // unlinked
+}
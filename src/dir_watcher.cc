@@ -0,0 +1,139 @@
+// Copyright 2019 Cristian Klein
+#include "src/dir_watcher.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include "src/logger.h"
+
+namespace fs = boost::filesystem;
+
+namespace cpprestconfig {
+
+namespace {
+
+std::string errno_string(const std::string &what, const std::string &dir) {
+    return what + " " + dir + ": " + strerror(errno);
+}
+
+}  // namespace
+
+DirWatcher::DirWatcher(
+    const std::string &dir,
+    Filter filter,
+    Handler fn,
+    std::chrono::milliseconds quiet,
+    std::chrono::milliseconds max_delay
+)
+    : _dir(dir),
+      _filter(filter),
+      _fn(fn),
+      _quiet(quiet),
+      _max_delay(max_delay),
+      _inotify_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+      _stop_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (_inotify_fd < 0 || _stop_fd < 0 ||
+            inotify_add_watch(_inotify_fd, dir.c_str(),
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        std::string error = errno_string("Cannot watch", dir);
+        if (_inotify_fd >= 0)
+            close(_inotify_fd);
+        if (_stop_fd >= 0)
+            close(_stop_fd);
+        throw std::runtime_error(error);
+    }
+    _thread = std::thread(&DirWatcher::run, this);
+}
+
+DirWatcher::~DirWatcher() {
+    uint64_t one = 1;
+    if (write(_stop_fd, &one, sizeof(one)) != sizeof(one))
+        logger()->warn("Cannot stop watching {}", _dir);
+    _thread.join();
+    close(_inotify_fd);
+    close(_stop_fd);
+}
+
+// Appends the names of pending events. Returns false if events were lost,
+// i.e., any file may have been written.
+bool DirWatcher::read_events(std::vector<std::string> *names) {
+    alignas(struct inotify_event) char buf[4096];
+    bool complete = true;
+    while (true) {
+        ssize_t n = read(_inotify_fd, buf, sizeof(buf));
+        if (n <= 0)
+            return complete;  // EAGAIN, i.e., read them all
+        for (char *p = buf; p < buf + n; ) {
+            auto event = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+                complete = false;
+            else if (event->len && _filter(event->name))
+                names->push_back(event->name);
+        }
+    }
+}
+
+void DirWatcher::run() {
+    using std::chrono::steady_clock;
+
+    struct pollfd fds[2] = {
+        { _inotify_fd, POLLIN, 0 },
+        { _stop_fd, POLLIN, 0 },
+    };
+    std::vector<std::string> names;
+    while (true) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents)
+            break;
+
+        names.clear();
+        bool complete = read_events(&names);
+        if (complete && names.empty())
+            continue;
+
+        // Gathers the rest of the burst.
+        auto deadline = steady_clock::now() + _max_delay;
+        while (true) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - steady_clock::now());
+            int timeout = std::min(left, _quiet).count();
+            if (timeout <= 0 || poll(fds, 2, timeout) <= 0)
+                break;
+            if (fds[1].revents)
+                return;
+            complete = read_events(&names) && complete;
+        }
+
+        try {
+            if (!complete) {
+                logger()->warn("Missed events in {}; reloading all files",
+                    _dir);
+                names.clear();
+                for (fs::directory_iterator it(_dir), end; it != end; ++it) {
+                    std::string name = it->path().filename().native();
+                    if (fs::is_regular_file(it->status()) && _filter(name))
+                        names.push_back(name);
+                }
+            }
+            std::sort(names.begin(), names.end());
+            names.erase(std::unique(names.begin(), names.end()),
+                names.end());
+            _fn(names);
+        } catch (const std::exception &ex) {
+            logger()->warn("Cannot reload files in {}; {}", _dir, ex.what());
+        }
+    }
+}
+
+}  // namespace cpprestconfig
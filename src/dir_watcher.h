@@ -0,0 +1,48 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_DIR_WATCHER_H_
+#define SRC_DIR_WATCHER_H_
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cpprestconfig {
+
+// Watches a directory with inotify, from a thread of its own, for files
+// written in place or moved into it. Events arriving within quiet of each
+// other, but at most for max_delay, are reported together, so that a tool
+// writing many files causes a single call to fn. Names rejected by filter,
+// e.g., temporary files, are never reported.
+class DirWatcher {
+ public:
+    typedef std::function<bool(const std::string &name)> Filter;
+    typedef std::function<void(const std::vector<std::string> &names)>
+        Handler;
+
+    DirWatcher(
+        const std::string &dir,
+        Filter filter,
+        Handler fn,
+        std::chrono::milliseconds quiet = std::chrono::milliseconds(1),
+        std::chrono::milliseconds max_delay = std::chrono::milliseconds(100));
+
+    // Waits for fn to return, if it is being called.
+    ~DirWatcher();
+
+ private:
+    void run();
+    bool read_events(std::vector<std::string> *names);
+
+    std::string _dir;
+    Filter _filter;
+    Handler _fn;
+    std::chrono::milliseconds _quiet, _max_delay;
+    int _inotify_fd, _stop_fd;
+    std::thread _thread;  // last, starts using the above
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_DIR_WATCHER_H_
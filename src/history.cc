@@ -0,0 +1,70 @@
+// Copyright 2019 Cristian Klein
+#include "src/history.h"
+
+#include <chrono>
+
+namespace cpprestconfig {
+
+const char *source_name(ChangeSource source) {
+    switch (source) {
+    case ChangeSource::Put:
+        return "put";
+    case ChangeSource::Batch:
+        return "batch";
+    case ChangeSource::Persist:
+        return "persist";
+    case ChangeSource::Rollback:
+        return "rollback";
+    case ChangeSource::Shared:
+        return "shared";
+    case ChangeSource::File:
+        return "file";
+    case ChangeSource::Snapshot:
+        return "snapshot";
+    }
+    return "unknown";
+}
+
+History::History(size_t capacity)
+    : _changes(capacity), _first(0), _size(0), _dropped(0) {
+    for (auto &change : _changes) {
+        // enough for all but strings, without allocating later
+        change.old_value.reserve(32);
+        change.new_value.reserve(32);
+    }
+}
+
+History::Change *History::record(
+    uint64_t generation,
+    size_t id,
+    ChangeSource source
+) {
+    Change *change;
+    if (_size < _changes.size()) {
+        change = &_changes[(_first + _size) % _changes.size()];
+        _size++;
+    } else {
+        change = &_changes[_first];
+        _dropped = change->generation;
+        _first = (_first + 1) % _changes.size();
+    }
+
+    change->generation = generation;
+    change->id = id;
+    change->time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    change->source = source;
+    return change;
+}
+
+bool History::values_at(uint64_t generation,
+        std::map<size_t, std::string> *values) const {
+    for_each([generation, values](const Change &change) {
+        // the oldest change after generation has the value at generation
+        if (change.generation > generation && !values->count(change.id))
+            (*values)[change.id] = change.old_value;
+    });
+    return generation >= _dropped;
+}
+
+}  // namespace cpprestconfig
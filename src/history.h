@@ -0,0 +1,67 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_HISTORY_H_
+#define SRC_HISTORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace cpprestconfig {
+
+enum class ChangeSource {
+    Put,  // PUT of a single key
+    Batch,  // POST or PATCH of several keys
+    Persist,  // loaded when starting, not recorded in the History
+    Rollback,  // POST <base>/_rollback
+    Shared,  // by the process sharing values with this one
+    File,  // a key file written into the persistence directory
+    Snapshot,  // PUT <base>/_snapshot
+};
+
+const char *source_name(ChangeSource source);
+
+// The latest changes, with the values before and after, so that they can
+// be undone. Entries are allocated once and overwritten when full; their
+// strings keep their capacity, so that recording a change does not
+// allocate, unless a value is longer than any before it in that entry.
+class History {
+ public:
+    struct Change {
+        uint64_t generation;  // the change was published with
+        size_t id;
+        uint64_t time_ms;  // since the Unix epoch
+        ChangeSource source;
+        std::string old_value, new_value;  // as persisted
+    };
+
+    explicit History(size_t capacity);
+
+    // Returns the entry to fill in for a new change, overwriting the oldest
+    // one if full. Changes must be recorded in generation order.
+    Change *record(uint64_t generation, size_t id, ChangeSource source);
+
+    // Calls fn for each change, oldest first.
+    template<typename F>
+    void for_each(F fn) const {
+        for (size_t i = 0; i < _size; i++)
+            fn(_changes[(_first + i) % _changes.size()]);
+    }
+
+    // Sets values to the value of each id changed after generation, as it
+    // was at that generation. Returns false if some of these changes were
+    // already overwritten.
+    bool values_at(uint64_t generation,
+        std::map<size_t, std::string> *values) const;
+
+ private:
+    std::vector<Change> _changes;
+    size_t _first, _size;
+    uint64_t _dropped;  // newest generation with overwritten changes
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_HISTORY_H_
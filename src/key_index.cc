@@ -0,0 +1,85 @@
+// Copyright 2019 Cristian Klein
+#include "src/key_index.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace cpprestconfig {
+
+const size_t KeyIndex::npos;
+
+namespace {
+
+const size_t kInitialSlots = 64;
+
+}  // namespace
+
+KeyIndex::KeyIndex() : _slots(kInitialSlots, Slot{0, npos}) {
+}
+
+// Returns the slot holding key, or the empty slot where it belongs.
+size_t KeyIndex::probe(const char *key, size_t size, uint64_t hash) const {
+    size_t mask = _slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const Slot &slot = _slots[i];
+        if (slot.id == npos)
+            return i;
+        if (slot.hash == hash) {
+            const std::string &k = _keys[slot.id];
+            if (k.size() == size && memcmp(k.data(), key, size) == 0)
+                return i;
+        }
+    }
+}
+
+size_t KeyIndex::find(const char *key, size_t size, uint64_t hash) const {
+    return _slots[probe(key, size, hash)].id;
+}
+
+std::pair<size_t, bool> KeyIndex::insert(
+    const char *key,
+    size_t size,
+    uint64_t hash
+) {
+    size_t i = probe(key, size, hash);
+    if (_slots[i].id != npos)
+        return std::make_pair(_slots[i].id, false);
+
+    if ((_keys.size() + 1) * 2 > _slots.size()) {
+        grow();
+        i = probe(key, size, hash);
+    }
+
+    _keys.push_back(std::string(key, size));
+    _slots[i] = Slot{hash, _keys.size() - 1};
+    return std::make_pair(_keys.size() - 1, true);
+}
+
+void KeyIndex::grow() {
+    std::vector<Slot> old(_slots.size() * 2, Slot{0, npos});
+    old.swap(_slots);
+
+    size_t mask = _slots.size() - 1;
+    for (auto const &slot : old) {
+        if (slot.id == npos)
+            continue;
+        size_t i = slot.hash & mask;
+        while (_slots[i].id != npos)
+            i = (i + 1) & mask;
+        _slots[i] = slot;
+    }
+}
+
+const std::vector<size_t> &KeyIndex::sorted() const {
+    if (_sorted.size() != _keys.size()) {
+        _sorted.resize(_keys.size());
+        for (size_t id = 0; id < _sorted.size(); id++)
+            _sorted[id] = id;
+        std::sort(_sorted.begin(), _sorted.end(), [this](size_t a, size_t b) {
+            return _keys[a] < _keys[b];
+        });
+    }
+    return _sorted;
+}
+
+}  // namespace cpprestconfig
@@ -0,0 +1,76 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_KEY_INDEX_H_
+#define SRC_KEY_INDEX_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cpprestconfig {
+
+// Same as the constexpr key_hash() of the public header, for keys known at
+// run time only.
+inline uint64_t key_hash(const char *key, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= static_cast<unsigned char>(key[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+inline uint64_t key_hash(const std::string &key) {
+    return key_hash(key.data(), key.size());
+}
+
+// Assigns consecutive ids to interned keys, and finds them in O(1) through
+// an open-addressing hash table. Keys are never removed, and references to
+// them stay valid.
+class KeyIndex {
+ public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    KeyIndex();
+
+    size_t find(const char *key, size_t size, uint64_t hash) const;
+    size_t find(const std::string &key) const {
+        return find(key.data(), key.size(), key_hash(key));
+    }
+
+    // Returns the id of key, and whether it was inserted.
+    std::pair<size_t, bool> insert(const char *key, size_t size, uint64_t hash);
+    std::pair<size_t, bool> insert(const std::string &key) {
+        return insert(key.data(), key.size(), key_hash(key));
+    }
+
+    const std::string &key(size_t id) const {
+        return _keys[id];
+    }
+
+    size_t size() const {
+        return _keys.size();
+    }
+
+    // Ids ordered by key, sorted again only after insertions.
+    const std::vector<size_t> &sorted() const;
+
+ private:
+    struct Slot {
+        uint64_t hash;
+        size_t id;  // npos if empty
+    };
+
+    size_t probe(const char *key, size_t size, uint64_t hash) const;
+    void grow();
+
+    std::deque<std::string> _keys;
+    std::vector<Slot> _slots;  // size is a power of two
+    mutable std::vector<size_t> _sorted;
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_KEY_INDEX_H_
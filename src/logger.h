@@ -0,0 +1,15 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_LOGGER_H_
+#define SRC_LOGGER_H_
+
+#include <memory>
+
+#include "spdlog/spdlog.h"
+
+namespace cpprestconfig {
+
+std::shared_ptr<spdlog::logger> logger();
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_LOGGER_H_
@@ -0,0 +1,174 @@
+// Copyright 2019 Cristian Klein
+#include "src/metrics.h"
+
+#include "spdlog/spdlog.h"
+
+namespace cpprestconfig {
+
+using std::to_string;
+
+namespace {
+
+// Upper bounds of the buckets, in seconds.
+const char *const kBucketBounds[Histogram::kBuckets] = {
+    "1e-06", "4e-06", "1.6e-05", "6.4e-05", "0.000256", "0.001024",
+    "0.004096", "0.016384", "0.065536", "0.262144", "1.048576", "4.194304",
+};
+
+// Methods served by the listener; anything else is counted as "other".
+const char *const kMethods[] = { "GET", "PUT", "POST", "PATCH", "other" };
+const size_t kNumMethods = sizeof(kMethods) / sizeof(kMethods[0]);
+
+const int kMinStatus = 100, kMaxStatus = 599;
+const size_t kNumStatus = kMaxStatus - kMinStatus + 1;
+
+const char *const kStages[] = {
+    "lookup", "parse", "publish", "persist", "callback",
+};
+const size_t kNumStages = sizeof(kStages) / sizeof(kStages[0]);
+
+// Counters are zero, since it is value-initialized.
+struct ServerMetrics {
+    std::atomic<uint64_t> requests[kNumMethods][kNumStatus];
+    Histogram request_duration[kNumMethods];
+    Histogram stage_duration[kNumStages];
+};
+
+ServerMetrics &server_metrics() {
+    static ServerMetrics *metrics = new ServerMetrics();  // never deleted
+    return *metrics;
+}
+
+size_t method_index(const std::string &method) {
+    for (size_t i = 0; i + 1 < kNumMethods; i++)
+        if (method == kMethods[i])
+            return i;
+    return kNumMethods - 1;
+}
+
+void render_counter(const std::string &name, const std::string &help,
+        uint64_t value, std::string *out) {
+    out->append(fmt::format("# HELP {} {}\n# TYPE {} counter\n{} {}\n",
+        name, help, name, name, value));
+}
+
+void render_gauge(const std::string &name, const std::string &help,
+        uint64_t value, std::string *out) {
+    out->append(fmt::format("# HELP {} {}\n# TYPE {} gauge\n{} {}\n",
+        name, help, name, name, value));
+}
+
+}  // namespace
+
+const size_t Histogram::kBuckets;
+
+Histogram::Histogram() : _sum_ns(0) {
+    for (auto &bucket : _buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+void Histogram::observe(std::chrono::steady_clock::duration elapsed) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        elapsed).count();
+    size_t bucket = 0;
+    for (uint64_t bound = 1000; bucket < kBuckets && ns > bound; bound *= 4)
+        bucket++;
+    _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    _sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void Histogram::render(const std::string &name, const std::string &labels,
+        std::string *out) const {
+    std::string sep = labels.empty() ? "" : ",";
+    uint64_t count = 0;
+    for (size_t i = 0; i <= kBuckets; i++) {
+        count += _buckets[i].load(std::memory_order_relaxed);
+        out->append(fmt::format("{}_bucket{{{}{}le=\"{}\"}} {}\n",
+            name, labels, sep, i < kBuckets ? kBucketBounds[i] : "+Inf",
+            count));
+    }
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    out->append(fmt::format("{}_sum{} {}\n", name, braces,
+        _sum_ns.load(std::memory_order_relaxed) / 1e9));
+    out->append(fmt::format("{}_count{} {}\n", name, braces, count));
+}
+
+StageTimer::StageTimer(Stage stage)
+    : _stage(stage), _start(std::chrono::steady_clock::now()) {
+}
+
+StageTimer::~StageTimer() {
+    server_metrics().stage_duration[static_cast<size_t>(_stage)].observe(
+        std::chrono::steady_clock::now() - _start);
+}
+
+void count_request(const std::string &method, int status_code,
+        std::chrono::steady_clock::duration elapsed) {
+    ServerMetrics &metrics = server_metrics();
+    size_t m = method_index(method);
+    if (status_code >= kMinStatus && status_code <= kMaxStatus) {
+        metrics.requests[m][status_code - kMinStatus].fetch_add(
+            1, std::memory_order_relaxed);
+    }
+    metrics.request_duration[m].observe(elapsed);
+}
+
+std::string render_metrics(size_t keys, const CallbackMetrics &callbacks) {
+    const ServerMetrics &metrics = server_metrics();
+    std::string out;
+
+    out.append(
+        "# HELP cpprestconfig_requests_total Requests served, by method and "
+        "status code\n"
+        "# TYPE cpprestconfig_requests_total counter\n");
+    for (size_t m = 0; m < kNumMethods; m++) {
+        for (size_t s = 0; s < kNumStatus; s++) {
+            uint64_t n = metrics.requests[m][s].load(
+                std::memory_order_relaxed);
+            if (n) {
+                out.append(fmt::format(
+                    "cpprestconfig_requests_total"
+                    "{{method=\"{}\",code=\"{}\"}} {}\n",
+                    kMethods[m], s + kMinStatus, n));
+            }
+        }
+    }
+
+    out.append(
+        "# HELP cpprestconfig_request_duration_seconds Time from receiving "
+        "a request to replying, by method\n"
+        "# TYPE cpprestconfig_request_duration_seconds histogram\n");
+    for (size_t m = 0; m < kNumMethods; m++) {
+        metrics.request_duration[m].render(
+            "cpprestconfig_request_duration_seconds",
+            fmt::format("method=\"{}\"", kMethods[m]), &out);
+    }
+
+    out.append(
+        "# HELP cpprestconfig_stage_duration_seconds Time spent in each "
+        "stage of serving changes\n"
+        "# TYPE cpprestconfig_stage_duration_seconds histogram\n");
+    for (size_t s = 0; s < kNumStages; s++) {
+        metrics.stage_duration[s].render(
+            "cpprestconfig_stage_duration_seconds",
+            fmt::format("stage=\"{}\"", kStages[s]), &out);
+    }
+
+    render_gauge("cpprestconfig_keys",
+        "Configuration variables registered", keys, &out);
+    render_counter("cpprestconfig_callbacks_queued_total",
+        "Asynchronous callbacks queued", callbacks.queued, &out);
+    render_counter("cpprestconfig_callbacks_coalesced_total",
+        "Asynchronous callbacks replaced by a later change",
+        callbacks.coalesced, &out);
+    render_counter("cpprestconfig_callbacks_overflowed_total",
+        "Asynchronous callbacks that waited for room, since the queue was "
+        "full", callbacks.overflowed, &out);
+    render_counter("cpprestconfig_callbacks_dispatched_total",
+        "Asynchronous callbacks called", callbacks.dispatched, &out);
+    render_gauge("cpprestconfig_callbacks_pending",
+        "Asynchronous callbacks queued or running", callbacks.pending, &out);
+    return out;
+}
+
+}  // namespace cpprestconfig
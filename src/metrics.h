@@ -0,0 +1,64 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_METRICS_H_
+#define SRC_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "cpprestconfig/cpprestconfig.h"
+
+namespace cpprestconfig {
+
+// Latency histogram with fixed buckets, from 1us to 4s in powers of 4.
+// Observing is lock-free, so that it can be done on every request.
+class Histogram {
+ public:
+    static const size_t kBuckets = 12;
+
+    Histogram();
+
+    void observe(std::chrono::steady_clock::duration elapsed);
+
+    // Appends the Prometheus text format of this histogram to out.
+    void render(const std::string &name, const std::string &labels,
+        std::string *out) const;
+
+ private:
+    std::atomic<uint64_t> _buckets[kBuckets + 1];  // last one is +Inf
+    std::atomic<uint64_t> _sum_ns;
+};
+
+// Stages of serving a change, which dominate for different workloads.
+enum class Stage {
+    Lookup,  // finding keys in the registry
+    Parse,  // converting and assigning values
+    Publish,  // building a snapshot of all values
+    Persist,  // writing values in the background
+    Callback,  // calling a callback, synchronously or not
+};
+
+// Observes the time spent in a stage, from construction to destruction.
+class StageTimer {
+ public:
+    explicit StageTimer(Stage stage);
+    ~StageTimer();
+
+ private:
+    Stage _stage;
+    std::chrono::steady_clock::time_point _start;
+};
+
+// Counts a request by method and status code, and observes its latency.
+void count_request(const std::string &method, int status_code,
+    std::chrono::steady_clock::duration elapsed);
+
+// Renders all metrics in the Prometheus text format.
+std::string render_metrics(size_t keys, const CallbackMetrics &callbacks);
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_METRICS_H_
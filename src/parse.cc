@@ -0,0 +1,138 @@
+// Copyright 2019 Cristian Klein
+#include "src/parse.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+namespace cpprestconfig {
+
+namespace {
+
+parse_error invalid(string_ref s, const char *type) {
+    return parse_error("'" + s.str() + "' is not a valid " + type);
+}
+
+// Like std::from_chars, with an optional sign.
+template<typename T>
+T parse_integer(string_ref s, const char *type) {
+    typedef typename std::make_unsigned<T>::type U;
+
+    const char *p = s.data(), *end = s.data() + s.size();
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    if (p == end || (negative && !std::numeric_limits<T>::is_signed))
+        throw invalid(s, type);
+
+    U limit = negative ?
+        static_cast<U>(std::numeric_limits<T>::max()) + 1 :
+        static_cast<U>(std::numeric_limits<T>::max());
+    U value = 0;
+    for (; p != end; p++) {
+        if (*p < '0' || *p > '9')
+            throw invalid(s, type);
+        U digit = *p - '0';
+        if (value > (limit - digit) / 10)
+            throw invalid(s, type);  // out of range
+        value = value * 10 + digit;
+    }
+    // i.e., two's complement negation, without overflowing for the minimum
+    return negative ? static_cast<T>(0 - value) : static_cast<T>(value);
+}
+
+// Whether s is [+-]digits[.digits][(e|E)[+-]digits], the digits before or
+// after the point being optional, but not both. Excludes what strtod()
+// accepts besides, i.e., nan, inf, hexadecimal and leading whitespace.
+bool is_decimal(string_ref s) {
+    const char *p = s.data(), *end = s.data() + s.size();
+    auto digits = [&p, end]() {
+        const char *begin = p;
+        while (p != end && *p >= '0' && *p <= '9')
+            p++;
+        return p != begin;
+    };
+
+    if (p != end && (*p == '-' || *p == '+'))
+        p++;
+    bool mantissa = digits();
+    if (p != end && *p == '.') {
+        p++;
+        mantissa = digits() || mantissa;
+    }
+    if (!mantissa)
+        return false;
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p != end && (*p == '-' || *p == '+'))
+            p++;
+        if (!digits())
+            return false;
+    }
+    return p == end;
+}
+
+}  // namespace
+
+template<>
+bool parse<bool>(string_ref s) {
+    if (s == "t" || s == "1" || s == "true")
+        return true;
+    if (s == "f" || s == "0" || s == "false")
+        return false;
+    throw invalid(s, "boolean");
+}
+
+template<>
+int parse<int>(string_ref s) {
+    return parse_integer<int>(s, "integer");
+}
+
+template<>
+int64_t parse<int64_t>(string_ref s) {
+    return parse_integer<int64_t>(s, "integer");
+}
+
+template<>
+uint64_t parse<uint64_t>(string_ref s) {
+    return parse_integer<uint64_t>(s, "unsigned integer");
+}
+
+// strtod() needs a terminated copy, which is kept on the stack unless the
+// number is unusually long. Checking the syntax first also keeps the
+// result independent of the locale, as long as its decimal point is '.'.
+template<>
+double parse<double>(string_ref s) {
+    if (!is_decimal(s))
+        throw invalid(s, "double");
+
+    char buf[64];
+    std::string long_copy;
+    const char *begin = buf;
+    if (s.size() < sizeof(buf)) {
+        memcpy(buf, s.data(), s.size());
+        buf[s.size()] = '\0';
+    } else {
+        long_copy = s.str();
+        begin = long_copy.c_str();
+    }
+
+    char *end;
+    double value = strtod(begin, &end);
+    if (end != begin + s.size() || !std::isfinite(value))
+        throw invalid(s, "double");
+    return value;
+}
+
+template<>
+std::string parse<std::string>(string_ref s) {
+    return s.str();
+}
+
+}  // namespace cpprestconfig
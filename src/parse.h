@@ -0,0 +1,54 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_PARSE_H_
+#define SRC_PARSE_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace cpprestconfig {
+
+// Characters owned by someone else, e.g., a request body, so that parsing
+// them needs no copy.
+class string_ref {
+ public:
+    string_ref(const char *data, size_t size) : _data(data), _size(size) {}
+    string_ref(const char *s) : _data(s), _size(strlen(s)) {}  // NOLINT
+    string_ref(const std::string &s)  // NOLINT
+        : _data(s.data()), _size(s.size()) {}
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    std::string str() const { return std::string(_data, _size); }
+
+ private:
+    const char *_data;
+    size_t _size;
+};
+
+inline bool operator==(string_ref a, string_ref b) {
+    return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// Thrown if the text is not a valid value of the type asked for.
+class parse_error : public std::invalid_argument {
+ public:
+    explicit parse_error(const std::string &what)
+        : std::invalid_argument(what) {}
+};
+
+// Parses the whole of s, as received over HTTP or persisted. Leading or
+// trailing whitespace and other characters after the value are errors.
+// Supports bool (true, false, t, f, 1, 0), int, int64_t, uint64_t, double
+// (finite, in decimal) and std::string. Does not allocate, except for
+// strings.
+template<typename T>
+T parse(string_ref s);
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_PARSE_H_
@@ -0,0 +1,686 @@
+// Copyright 2019 Cristian Klein
+#include "src/persist.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include "src/key_index.h"
+#include "src/logger.h"
+#include "src/metrics.h"
+
+namespace cpprestconfig {
+
+namespace fs = boost::filesystem;
+
+const char *JournalPersist::kFileName = "config.journal";
+const char *MmapPersist::kFileName = "config.mmap";
+const size_t MmapPersist::kMaxRecordData;
+
+bool is_key_file(const std::string &name) {
+    const std::string tmp = ".tmp";
+    return !name.empty() && name[0] != '.' &&
+        name.compare(0, strlen(JournalPersist::kFileName),
+            JournalPersist::kFileName) != 0 &&
+        name.compare(0, strlen(MmapPersist::kFileName),
+            MmapPersist::kFileName) != 0 &&
+        !(name.size() >= tmp.size() &&
+            name.compare(name.size() - tmp.size(), tmp.size(), tmp) == 0);
+}
+
+std::vector<std::string> key_files(const std::string &dir) {
+    std::vector<std::string> names;
+    for (fs::directory_iterator it(dir), end; it != end; ++it) {
+        std::string name = it->path().filename().native();
+        if (fs::is_regular_file(it->status()) && is_key_file(name))
+            names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+bool read_key_file(const std::string &path, std::string *value) {
+    std::ifstream ifs(path);
+    if (!ifs)
+        return false;
+    value->assign(
+        std::istreambuf_iterator<char>(ifs),
+        std::istreambuf_iterator<char>());
+    if (!value->empty() && (*value)[value->size() - 1] == '\n')
+        value->resize(value->size() - 1);
+    return true;
+}
+
+namespace {
+
+const char kJournalMagic[] = "CPRCJNL1";
+const size_t kJournalMagicSize = sizeof(kJournalMagic) - 1;
+
+uint32_t checksum(const char *data, size_t size) {
+    boost::crc_32_type crc;
+    crc.process_bytes(data, size);
+    return crc.checksum();
+}
+
+void append_uint32(std::string *buf, uint32_t v) {
+    buf->append(reinterpret_cast<const char *>(&v), sizeof(v));
+}
+
+bool read_uint32(const std::string &buf, size_t *pos, uint32_t *v) {
+    if (buf.size() - *pos < sizeof(*v))
+        return false;
+    memcpy(v, buf.data() + *pos, sizeof(*v));
+    *pos += sizeof(*v);
+    return true;
+}
+
+// A record is: key size, value size, key, value, then the CRC-32 of all of
+// the previous, with integers in host byte order.
+void append_record(
+    std::string *buf,
+    const std::string &key,
+    const std::string &value
+) {
+    size_t start = buf->size();
+    append_uint32(buf, key.size());
+    append_uint32(buf, value.size());
+    buf->append(key);
+    buf->append(value);
+    append_uint32(buf, checksum(buf->data() + start, buf->size() - start));
+}
+
+// Returns false, leaving pos untouched, if no complete and valid record
+// starts at pos.
+bool read_record(
+    const std::string &buf,
+    size_t *pos,
+    std::string *key,
+    std::string *value
+) {
+    size_t p = *pos;
+    uint32_t key_size, value_size, crc;
+    if (!read_uint32(buf, &p, &key_size) || !read_uint32(buf, &p, &value_size))
+        return false;
+    if (buf.size() - p < static_cast<size_t>(key_size) + value_size)
+        return false;
+    size_t data = p;
+    p += key_size + value_size;
+    if (!read_uint32(buf, &p, &crc))
+        return false;
+    if (crc != checksum(buf.data() + *pos, p - sizeof(crc) - *pos))
+        return false;
+
+    key->assign(buf, data, key_size);
+    value->assign(buf, data + key_size, value_size);
+    *pos = p;
+    return true;
+}
+
+std::string errno_string(const std::string &what, const std::string &path) {
+    return what + " " + path + ": " + strerror(errno);
+}
+
+void write_all(int fd, const std::string &buf, const std::string &path) {
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t n = ::write(fd, buf.data() + written, buf.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(errno_string("Cannot write", path));
+        }
+        written += n;
+    }
+}
+
+std::string read_all(int fd, const std::string &path) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error(errno_string("Cannot stat", path));
+
+    std::string buf(st.st_size, '\0');
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = pread(fd, &buf[done], buf.size() - done, done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(errno_string("Cannot read", path));
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    buf.resize(done);
+    return buf;
+}
+
+void sync_dir(const std::string &dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+}  // namespace
+
+JournalPersist::JournalPersist(const std::string &dir)
+    : _dir(dir),
+      _path((fs::path(dir) / kFileName).native()),
+      _fd(-1),
+      _records(0) {
+    if (fs::exists(_path)) {
+        replay();
+    } else {
+        import_legacy();
+        compact();
+    }
+}
+
+JournalPersist::~JournalPersist() {
+    if (_fd >= 0)
+        close(_fd);
+}
+
+bool JournalPersist::load(const std::string &key, std::string *value) {
+    auto it = _values.find(key);
+    if (it == _values.end())
+        return false;
+    *value = it->second;
+    return true;
+}
+
+void JournalPersist::save(const PersistValues &values) {
+    std::string buf;
+    for (auto const &v : values) {
+        append_record(&buf, v.first, v.second);
+        _values[v.first] = v.second;
+    }
+
+    write_all(_fd, buf, _path);
+    if (fdatasync(_fd) != 0)
+        throw std::runtime_error(errno_string("Cannot sync", _path));
+    _records += values.size();
+
+    if (_records > 2 * _values.size() + 64)
+        compact();
+}
+
+void JournalPersist::replay() {
+    _fd = open(_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    if (_fd < 0)
+        throw std::runtime_error(errno_string("Cannot open", _path));
+
+    std::string buf = read_all(_fd, _path);
+    if (buf.compare(0, kJournalMagicSize, kJournalMagic) != 0) {
+        logger()->warn("{} is not a journal; ignoring it", _path);
+        compact();
+        return;
+    }
+
+    size_t pos = kJournalMagicSize;
+    std::string key, value;
+    while (read_record(buf, &pos, &key, &value)) {
+        _values[key] = value;
+        _records++;
+    }
+
+    if (pos != buf.size()) {
+        logger()->warn("{}: discarding {} bytes of torn or corrupt records",
+            _path, buf.size() - pos);
+        if (ftruncate(_fd, pos) != 0)
+            throw std::runtime_error(errno_string("Cannot truncate", _path));
+    }
+
+    logger()->info("Replayed {} records for {} keys from {}",
+        _records, _values.size(), _path);
+}
+
+void JournalPersist::import_legacy() {
+    std::string value;
+    for (auto const &key : key_files(_dir)) {
+        if (read_key_file((fs::path(_dir) / key).native(), &value))
+            _values[key] = value;
+    }
+
+    if (!_values.empty()) {
+        logger()->info("Imported {} keys from legacy files in {}",
+            _values.size(), _dir);
+    }
+}
+
+// Atomically replaces the journal with one holding only live values.
+void JournalPersist::compact() {
+    std::string tmpPath = _path + ".tmp";
+
+    std::string buf(kJournalMagic, kJournalMagicSize);
+    for (auto const &v : _values)
+        append_record(&buf, v.first, v.second);
+
+    int fd = open(tmpPath.c_str(),
+        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::runtime_error(errno_string("Cannot open", tmpPath));
+    try {
+        write_all(fd, buf, tmpPath);
+        if (fdatasync(fd) != 0)
+            throw std::runtime_error(errno_string("Cannot sync", tmpPath));
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    if (rename(tmpPath.c_str(), _path.c_str()) != 0) {
+        close(fd);
+        throw std::runtime_error(errno_string("Cannot rename", tmpPath));
+    }
+    sync_dir(_dir);
+
+    // fd now refers to the journal; reopen it in append mode
+    close(fd);
+    if (_fd >= 0)
+        close(_fd);
+    _fd = open(_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+    if (_fd < 0)
+        throw std::runtime_error(errno_string("Cannot open", _path));
+    _records = _values.size();
+}
+
+struct MmapPersist::Header {
+    char magic[8];
+    uint32_t capacity;  // number of slots, a power of two
+    uint32_t count;  // number of used slots
+    char reserved[240];
+};
+
+struct MmapPersist::Record {
+    uint32_t crc;  // of all fields below
+    uint32_t seq;  // 0 if never written; the highest valid copy wins
+    uint64_t hash;
+    uint16_t key_size;
+    uint16_t value_size;
+    char data[kMaxRecordData];  // key, then value
+};
+
+struct MmapPersist::Slot {
+    Record copies[2];
+};
+
+namespace {
+
+const char kMmapMagic[] = "CPRCMAP1";
+const uint32_t kMmapInitialCapacity = 1024;
+
+uint32_t record_checksum(const void *record, size_t size) {
+    return checksum(static_cast<const char *>(record) + sizeof(uint32_t),
+        size - sizeof(uint32_t));
+}
+
+// Returns the newest valid copy of a slot's record, or NULL.
+template<typename Record, typename Slot>
+const Record *current(const Slot &slot) {
+    const Record *best = NULL;
+    for (auto const &r : slot.copies) {
+        if (r.seq == 0 || r.crc != record_checksum(&r, sizeof(r)))
+            continue;
+        if (!best || r.seq > best->seq)
+            best = &r;
+    }
+    return best;
+}
+
+}  // namespace
+
+MmapPersist::MmapPersist(const std::string &dir)
+    : _dir(dir),
+      _path((fs::path(dir) / kFileName).native()),
+      _fd(-1),
+      _base(NULL),
+      _size(0),
+      _header(NULL),
+      _slots(NULL) {
+    static_assert(sizeof(Header) == 256, "unexpected header layout");
+    static_assert(sizeof(Record) == 128, "unexpected record layout");
+
+    if (fs::exists(_path) && open_existing())
+        return;
+
+    JournalPersist journal(dir);
+    uint32_t capacity = kMmapInitialCapacity;
+    while (journal.values().size() * 10 > capacity * 7)
+        capacity *= 2;
+    create(capacity,
+        PersistValues(journal.values().begin(), journal.values().end()));
+}
+
+MmapPersist::~MmapPersist() {
+    unmap();
+}
+
+void MmapPersist::unmap() {
+    if (_base)
+        munmap(_base, _size);
+    if (_fd >= 0)
+        close(_fd);
+    _base = NULL;
+    _fd = -1;
+}
+
+bool MmapPersist::open_existing() {
+    _fd = open(_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (_fd < 0)
+        throw std::runtime_error(errno_string("Cannot open", _path));
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+        throw std::runtime_error(errno_string("Cannot stat", _path));
+    _size = st.st_size;
+
+    if (_size >= sizeof(Header)) {
+        void *base = mmap(NULL, _size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (base == MAP_FAILED)
+            throw std::runtime_error(errno_string("Cannot map", _path));
+        _base = static_cast<char *>(base);
+        _header = reinterpret_cast<Header *>(_base);
+        _slots = reinterpret_cast<Slot *>(_base + sizeof(Header));
+
+        uint32_t capacity = _header->capacity;
+        if (memcmp(_header->magic, kMmapMagic, sizeof(_header->magic)) == 0 &&
+                capacity != 0 && (capacity & (capacity - 1)) == 0 &&
+                _size == sizeof(Header) + capacity * sizeof(Slot)) {
+            logger()->info("Mapped {} keys from {}", _header->count, _path);
+            return true;
+        }
+    }
+
+    logger()->warn("{} is not a valid mmap file; ignoring it", _path);
+    unmap();
+    return false;
+}
+
+// Atomically replaces the file with one of the given capacity, holding
+// values. The new file is complete and durable before it is renamed, so
+// that a crash leaves either the old file or the new one.
+void MmapPersist::create(uint32_t capacity, const PersistValues &values) {
+    std::string tmpPath = _path + ".tmp";
+    size_t size = sizeof(Header) + capacity * sizeof(Slot);
+
+    int fd = open(tmpPath.c_str(),
+        O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::runtime_error(errno_string("Cannot open", tmpPath));
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        throw std::runtime_error(errno_string("Cannot resize", tmpPath));
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error(errno_string("Cannot map", tmpPath));
+    }
+
+    // Fills the new file through the members, then keeps either it or,
+    // if anything failed, the old one.
+    int old_fd = _fd;
+    char *old_base = _base;
+    size_t old_size = _size;
+    Header *old_header = _header;
+    Slot *old_slots = _slots;
+    _fd = fd;
+    _base = static_cast<char *>(base);
+    _size = size;
+    _header = reinterpret_cast<Header *>(_base);
+    _slots = reinterpret_cast<Slot *>(_base + sizeof(Header));
+    try {
+        memcpy(_header->magic, kMmapMagic, sizeof(_header->magic));
+        _header->capacity = capacity;
+        _header->count = 0;  // the rest is zeroed by ftruncate()
+        for (auto const &v : values)
+            put(v.first, v.second);
+
+        if (msync(_base, _size, MS_SYNC) != 0)
+            throw std::runtime_error(errno_string("Cannot sync", tmpPath));
+        if (rename(tmpPath.c_str(), _path.c_str()) != 0)
+            throw std::runtime_error(errno_string("Cannot rename", tmpPath));
+    } catch (...) {
+        unmap();
+        _fd = old_fd;
+        _base = old_base;
+        _size = old_size;
+        _header = old_header;
+        _slots = old_slots;
+        throw;
+    }
+    sync_dir(_dir);
+
+    if (old_base)
+        munmap(old_base, old_size);
+    if (old_fd >= 0)
+        close(old_fd);
+}
+
+// Linear probing; returns the slot holding key, or the empty slot where it
+// should be inserted.
+MmapPersist::Slot *MmapPersist::find(
+    const std::string &key,
+    uint64_t hash,
+    bool *found
+) const {
+    uint32_t mask = _header->capacity - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        Slot *slot = &_slots[i];
+        if (slot->copies[0].seq == 0 && slot->copies[1].seq == 0) {
+            *found = false;
+            return slot;
+        }
+        const Record *r = current<Record>(*slot);
+        if (r && r->hash == hash && r->key_size == key.size() &&
+                memcmp(r->data, key.data(), key.size()) == 0) {
+            *found = true;
+            return slot;
+        }
+    }
+}
+
+bool MmapPersist::load(const std::string &key, std::string *value) {
+    bool found;
+    const Slot *slot = find(key, key_hash(key), &found);
+    if (!found)
+        return false;
+    const Record *r = current<Record>(*slot);
+    value->assign(r->data + r->key_size, r->value_size);
+    return true;
+}
+
+// Overwrites the older copy, leaving the current one intact until the new
+// one is complete.
+void MmapPersist::store(
+    Slot *slot,
+    bool found,
+    uint64_t hash,
+    const std::string &key,
+    const std::string &value
+) {
+    const Record *cur = found ? current<Record>(*slot) : NULL;
+    Record *r = cur == &slot->copies[0] ? &slot->copies[1] : &slot->copies[0];
+
+    Record tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.seq = cur ? cur->seq + 1 : 1;
+    tmp.hash = hash;
+    tmp.key_size = key.size();
+    tmp.value_size = value.size();
+    memcpy(tmp.data, key.data(), key.size());
+    memcpy(tmp.data + key.size(), value.data(), value.size());
+    tmp.crc = record_checksum(&tmp, sizeof(tmp));
+    *r = tmp;
+}
+
+// Skips values that do not fit, rather than losing the rest of the batch.
+void MmapPersist::put(const std::string &key, const std::string &value) {
+    if (key.size() + value.size() > kMaxRecordData) {
+        logger()->warn("Did not persist {}; it and its value do not fit in {}",
+            key, _path);
+        return;
+    }
+
+    uint64_t hash = key_hash(key);
+    bool found;
+    Slot *slot = find(key, hash, &found);
+    if (!found) {
+        if ((_header->count + 1) * 10 > _header->capacity * 7) {
+            grow();
+            slot = find(key, hash, &found);
+        }
+        _header->count++;
+    }
+    store(slot, found, hash, key, value);
+}
+
+void MmapPersist::save(const PersistValues &values) {
+    for (auto const &v : values)
+        put(v.first, v.second);
+
+    if (msync(_base, _size, MS_SYNC) != 0)
+        throw std::runtime_error(errno_string("Cannot sync", _path));
+}
+
+// Rehashes all records into a file of twice the capacity.
+void MmapPersist::grow() {
+    PersistValues values;
+    for (uint32_t i = 0; i < _header->capacity; i++) {
+        const Record *r = current<Record>(_slots[i]);
+        if (r) {
+            values.push_back(std::make_pair(
+                std::string(r->data, r->key_size),
+                std::string(r->data + r->key_size, r->value_size)));
+        }
+    }
+
+    create(_header->capacity * 2, values);
+}
+
+PersistWriter::PersistWriter(
+    std::unique_ptr<PersistBackend> backend,
+    std::chrono::milliseconds interval)
+    : _backend(std::move(backend)),
+      _interval(interval),
+      _enqueued_seq(0),
+      _written_seq(0),
+      _flush_requested(false),
+      _stopping(false) {
+    _thread = std::thread(&PersistWriter::run, this);
+}
+
+PersistWriter::~PersistWriter() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wakeup.notify_one();
+    _thread.join();
+}
+
+bool PersistWriter::load(const std::string &key, std::string *value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _dirty.find(key);
+    if (it != _dirty.end()) {
+        *value = it->second;
+        return true;
+    }
+
+    // waits for a write in progress, which may hold key
+    std::lock_guard<std::mutex> backend_lock(_backend_mutex);
+    return _backend->load(key, value);
+}
+
+void PersistWriter::load(
+    const std::vector<const std::string *> &keys,
+    const std::function<void(size_t i, const std::string &value)> &fn
+) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::lock_guard<std::mutex> backend_lock(_backend_mutex);
+    std::string value;
+    for (size_t i = 0; i < keys.size(); i++) {
+        auto it = _dirty.find(*keys[i]);
+        if (it != _dirty.end())
+            fn(i, it->second);
+        else if (_backend->load(*keys[i], &value))
+            fn(i, value);
+    }
+}
+
+void PersistWriter::enqueue(const PersistValues &values) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto const &v : values)
+            _dirty[v.first] = v.second;
+        _enqueued_seq++;
+    }
+    _wakeup.notify_one();
+}
+
+void PersistWriter::flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t seq = _enqueued_seq;
+    _flush_requested = true;
+    _wakeup.notify_one();
+    _written.wait(lock, [this, seq]() { return _written_seq >= seq; });
+}
+
+void PersistWriter::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _wakeup.wait(lock, [this]() {
+            return _stopping || _flush_requested || !_dirty.empty();
+        });
+        if (!_stopping && !_flush_requested) {
+            // let more changes to the same keys accumulate
+            _wakeup.wait_for(lock, _interval, [this]() {
+                return _stopping || _flush_requested;
+            });
+        }
+        if (_stopping && _dirty.empty())
+            break;
+
+        PersistValues values(_dirty.begin(), _dirty.end());
+        _dirty.clear();
+        _flush_requested = false;
+        uint64_t seq = _enqueued_seq;
+
+        std::unique_lock<std::mutex> backend_lock(_backend_mutex);
+        lock.unlock();
+        if (!values.empty()) {
+            try {
+                StageTimer timer(Stage::Persist);
+                _backend->save(values);
+                logger()->info("saved {} value(s)", values.size());
+            } catch (const std::exception &ex) {
+                logger()->warn("saving {} value(s) failed; {}",
+                    values.size(), ex.what());
+            }
+        }
+        backend_lock.unlock();
+        lock.lock();
+
+        _written_seq = seq;
+        _written.notify_all();
+    }
+
+    _written_seq = _enqueued_seq;
+    _written.notify_all();
+}
+
+}  // namespace cpprestconfig
@@ -0,0 +1,157 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_PERSIST_H_
+#define SRC_PERSIST_H_
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace cpprestconfig {
+
+typedef std::vector<std::pair<std::string, std::string>> PersistValues;
+
+// Storage for persisted values, kept as strings indexed by key.
+class PersistBackend {
+ public:
+    virtual ~PersistBackend() {}
+
+    // Returns false if no value was persisted for key.
+    virtual bool load(const std::string &key, std::string *value) = 0;
+
+    // Persists all values with a single write.
+    virtual void save(const PersistValues &values) = 0;
+};
+
+// A single append-only file of checksummed records. It is replayed with one
+// sequential read, a torn record at its end is discarded, and it is
+// rewritten once stale records outnumber live ones. A directory holding one
+// file per key, as written by older versions, is imported on first use.
+class JournalPersist : public PersistBackend {
+ public:
+    explicit JournalPersist(const std::string &dir);
+    ~JournalPersist();
+
+    bool load(const std::string &key, std::string *value) override;
+    void save(const PersistValues &values) override;
+
+    const std::map<std::string, std::string> &values() const {
+        return _values;
+    }
+
+    static const char *kFileName;
+
+ private:
+    void replay();
+    void import_legacy();
+    void compact();
+
+    std::string _dir, _path;
+    int _fd;
+    std::map<std::string, std::string> _values;
+    size_t _records;
+};
+
+// A fixed-layout file, memory-mapped and indexed by key hash, so that
+// loading costs one mmap() plus one lookup per key. Each slot holds two
+// checksummed copies of its record, written alternately, so that a torn
+// write loses at most the change being written. A key and its value must
+// fit in kMaxRecordData bytes; others are logged and not persisted. On
+// first use, values are imported from the journal or from legacy files.
+class MmapPersist : public PersistBackend {
+ public:
+    explicit MmapPersist(const std::string &dir);
+    ~MmapPersist();
+
+    bool load(const std::string &key, std::string *value) override;
+    void save(const PersistValues &values) override;
+
+    static const char *kFileName;
+    static const size_t kMaxRecordData = 108;
+
+ private:
+    struct Header;
+    struct Record;
+    struct Slot;
+
+    void create(uint32_t capacity, const PersistValues &values);
+    bool open_existing();
+    void unmap();
+    void put(const std::string &key, const std::string &value);
+    void grow();
+    Slot *find(const std::string &key, uint64_t hash, bool *found) const;
+    void store(Slot *slot, bool found, uint64_t hash,
+        const std::string &key, const std::string &value);
+
+    std::string _dir, _path;
+    int _fd;
+    char *_base;
+    size_t _size;
+    Header *_header;
+    Slot *_slots;
+};
+
+// Whether name is a file holding the value of the key it is named after,
+// as written by older versions or by other tools, rather than a file of
+// the library itself, e.g., a journal, or a hidden or temporary file.
+bool is_key_file(const std::string &name);
+
+// Names of the key files in dir, sorted.
+std::vector<std::string> key_files(const std::string &dir);
+
+// Reads the value of a key file, without the newline ending it, if any,
+// e.g., as written by echo. Returns false if the file cannot be opened,
+// e.g., since it was removed.
+bool read_key_file(const std::string &path, std::string *value);
+
+// Saves to a PersistBackend from a background thread, so that callers do
+// not wait for the disk. Values enqueued for the same key within one flush
+// interval collapse into a single write. Pending values are written when
+// the writer is destroyed.
+class PersistWriter {
+ public:
+    PersistWriter(
+        std::unique_ptr<PersistBackend> backend,
+        std::chrono::milliseconds interval);
+    ~PersistWriter();
+
+    // Also sees values that are still pending.
+    bool load(const std::string &key, std::string *value);
+
+    // Same as load(), for many keys while taking the locks once: calls
+    // fn(i, value) for each keys[i] that was persisted.
+    void load(const std::vector<const std::string *> &keys,
+        const std::function<void(size_t i, const std::string &value)> &fn);
+
+    void enqueue(const PersistValues &values);
+
+    // Blocks until all values enqueued so far are durable.
+    void flush();
+
+ private:
+    void run();
+
+    std::unique_ptr<PersistBackend> _backend;
+    std::chrono::milliseconds _interval;
+
+    // Lock order is _mutex, then _backend_mutex.
+    std::mutex _mutex, _backend_mutex;
+    std::condition_variable _wakeup, _written;
+    std::map<std::string, std::string> _dirty;
+    uint64_t _enqueued_seq, _written_seq;
+    bool _flush_requested, _stopping;
+
+    std::thread _thread;
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_PERSIST_H_
@@ -0,0 +1,157 @@
+// Copyright 2019 Cristian Klein
+#include "src/read_stats.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+
+namespace cpprestconfig {
+
+namespace {
+
+struct ReadCounter {
+    // Only written by the owning thread, hence no read-modify-write.
+    std::atomic<uint64_t> reads;
+    std::atomic<uint64_t> last_read_ms;
+};
+
+// Counters of one thread, in chunks allocated on first use, so that they
+// never move while other threads sum them up.
+class ReadShard {
+ public:
+    static const size_t kChunkSize = 1024;
+    static const size_t kMaxChunks = 1024;  // i.e., up to 1M keys
+
+    ReadShard() {
+        for (auto &chunk : _chunks)
+            chunk.store(NULL, std::memory_order_relaxed);
+    }
+
+    ~ReadShard() {
+        for (auto &chunk : _chunks)
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    // Returns NULL if id is too large to be counted.
+    ReadCounter *counter(size_t id) {
+        size_t c = id / kChunkSize;
+        if (c >= kMaxChunks)
+            return NULL;
+        ReadCounter *chunk = _chunks[c].load(std::memory_order_relaxed);
+        if (!chunk) {
+            chunk = new ReadCounter[kChunkSize]();
+            _chunks[c].store(chunk, std::memory_order_release);
+        }
+        return &chunk[id % kChunkSize];
+    }
+
+    // Number of ids covered by the allocated chunks.
+    size_t extent() const {
+        for (size_t c = kMaxChunks; c > 0; c--)
+            if (_chunks[c - 1].load(std::memory_order_relaxed))
+                return c * kChunkSize;
+        return 0;
+    }
+
+    void add_to(std::vector<ReadStats> *stats) const {
+        for (size_t id = 0; id < stats->size(); id += kChunkSize) {
+            size_t c = id / kChunkSize;
+            if (c >= kMaxChunks)
+                break;
+            const ReadCounter *chunk =
+                _chunks[c].load(std::memory_order_acquire);
+            if (!chunk)
+                continue;
+            size_t end = std::min(kChunkSize, stats->size() - id);
+            for (size_t i = 0; i < end; i++) {
+                ReadStats &s = (*stats)[id + i];
+                s.reads += chunk[i].reads.load(std::memory_order_relaxed);
+                s.last_read_ms = std::max(s.last_read_ms,
+                    chunk[i].last_read_ms.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+ private:
+    std::atomic<ReadCounter *> _chunks[kMaxChunks];
+};
+
+const size_t ReadShard::kChunkSize;
+const size_t ReadShard::kMaxChunks;
+
+// Never deleted, since threads may exit after static destruction.
+struct ReadShards {
+    std::mutex mutex;
+    std::set<ReadShard *> live;
+    std::vector<ReadStats> exited;  // sum of the shards of exited threads
+};
+
+ReadShards &read_shards() {
+    static ReadShards *shards = new ReadShards();
+    return *shards;
+}
+
+struct ReadShardOwner {
+    ReadShard *shard = NULL;
+    ~ReadShardOwner() {
+        if (!shard)
+            return;
+        ReadShards &shards = read_shards();
+        std::lock_guard<std::mutex> lock(shards.mutex);
+        shards.live.erase(shard);
+        if (shards.exited.size() < shard->extent())
+            shards.exited.resize(shard->extent(), ReadStats{0, 0});
+        shard->add_to(&shards.exited);
+        delete shard;
+    }
+};
+
+thread_local ReadShard *tls_read_shard = NULL;
+thread_local ReadShardOwner tls_read_shard_owner;
+
+ReadShard *acquire_shard() {
+    ReadShard *shard = new ReadShard();
+    ReadShards &shards = read_shards();
+    std::lock_guard<std::mutex> lock(shards.mutex);
+    shards.live.insert(shard);
+    tls_read_shard_owner.shard = shard;
+    tls_read_shard = shard;
+    return shard;
+}
+
+// Resolution is a few milliseconds, but reading it is cheap.
+uint64_t coarse_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+}  // namespace
+
+void count_read(size_t id) {
+    ReadShard *shard = tls_read_shard ? tls_read_shard : acquire_shard();
+    ReadCounter *c = shard->counter(id);
+    if (!c)
+        return;
+    c->reads.store(
+        c->reads.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    c->last_read_ms.store(coarse_now_ms(), std::memory_order_relaxed);
+}
+
+std::vector<ReadStats> read_stats(size_t n) {
+    std::vector<ReadStats> stats(n, ReadStats{0, 0});
+
+    ReadShards &shards = read_shards();
+    std::lock_guard<std::mutex> lock(shards.mutex);
+    for (size_t id = 0; id < n && id < shards.exited.size(); id++)
+        stats[id] = shards.exited[id];
+    for (auto shard : shards.live)
+        shard->add_to(&stats);
+    return stats;
+}
+
+}  // namespace cpprestconfig
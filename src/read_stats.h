@@ -0,0 +1,26 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_READ_STATS_H_
+#define SRC_READ_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace cpprestconfig {
+
+struct ReadStats {
+    uint64_t reads;
+    uint64_t last_read_ms;  // since the Unix epoch, 0 if never read
+};
+
+// Counts a read of the key with id by the calling thread. Each thread counts
+// into a shard of its own, so reads never contend with each other.
+void count_read(size_t id);
+
+// Sums up the reads of ids [0, n) over all threads, including exited ones.
+std::vector<ReadStats> read_stats(size_t n);
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_READ_STATS_H_
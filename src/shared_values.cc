@@ -0,0 +1,283 @@
+// Copyright 2019 Cristian Klein
+#include "src/shared_values.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace cpprestconfig {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+    "atomics shared between processes must be lock-free");
+
+struct SharedValues::Header {
+    char magic[8];
+    uint32_t slots;
+    uint32_t slot_size;
+    std::atomic<uint32_t> generation;  // also the futex word
+    std::atomic<uint32_t> removed;  // set just before unlinking
+    char reserved[40];
+};
+
+struct SharedValues::Slot {
+    std::atomic<uint32_t> seq;  // odd while the value is being written
+    std::atomic<uint32_t> key_size;  // 0 while free, never changes after
+    uint64_t hash;
+    char key[kMaxKey];
+    std::atomic<uint64_t> value_size;
+    // Words rather than chars, so that readers racing with the writer read
+    // atomically, if inconsistently, before retrying.
+    std::atomic<uint64_t> value[kMaxValue / sizeof(uint64_t)];
+};
+
+namespace {
+
+const char kSharedMagic[] = "CPRCSHM1";
+
+std::string errno_string(const std::string &what, const std::string &name) {
+    return what + " " + name + ": " + strerror(errno);
+}
+
+long futex(const std::atomic<uint32_t> *word, int op, uint32_t value,  // NOLINT
+        const struct timespec *timeout) {
+    return syscall(SYS_futex, reinterpret_cast<const uint32_t *>(word), op,
+        value, timeout, NULL, 0);
+}
+
+}  // namespace
+
+const uint32_t SharedValues::kSlots;
+const size_t SharedValues::kMaxKey;
+const size_t SharedValues::kMaxValue;
+
+std::unique_ptr<SharedValues> SharedValues::create(const std::string &name) {
+    static_assert(sizeof(Header) == 64, "unexpected header layout");
+    static_assert(sizeof(Slot) == 400, "unexpected slot layout");
+    size_t size = sizeof(Header) + kSlots * sizeof(Slot);
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        throw std::runtime_error(errno_string("Cannot open", name));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error(errno_string("Cannot stat", name));
+    }
+    bool resize = static_cast<size_t>(st.st_size) != size;
+    // i.e., zeroes a segment of another layout
+    if (resize && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+        close(fd);
+        throw std::runtime_error(errno_string("Cannot resize", name));
+    }
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        throw std::runtime_error(errno_string("Cannot map", name));
+
+    std::unique_ptr<SharedValues> shared(
+        new SharedValues(name, static_cast<char *>(base), size));
+    Header *header = shared->_header;
+    if (resize || memcmp(header->magic, kSharedMagic, 8) != 0 ||
+            header->slots != kSlots || header->slot_size != sizeof(Slot)) {
+        memset(base, 0, size);
+        header->slots = kSlots;
+        header->slot_size = sizeof(Slot);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, kSharedMagic, 8);  // last, readers check it
+    }
+    // e.g., left by a writer that could not unlink it
+    header->removed.store(0, std::memory_order_release);
+    return shared;
+}
+
+std::unique_ptr<SharedValues> SharedValues::open(const std::string &name) {
+    size_t size = sizeof(Header) + kSlots * sizeof(Slot);
+
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return std::unique_ptr<SharedValues>();
+        throw std::runtime_error(errno_string("Cannot open", name));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != size) {
+        close(fd);
+        return std::unique_ptr<SharedValues>();  // being created
+    }
+
+    void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        throw std::runtime_error(errno_string("Cannot map", name));
+
+    std::unique_ptr<SharedValues> shared(
+        new SharedValues(name, static_cast<char *>(base), size));
+    Header *header = shared->_header;
+    if (memcmp(header->magic, kSharedMagic, 8) != 0)
+        return std::unique_ptr<SharedValues>();  // being created
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->slots != kSlots || header->slot_size != sizeof(Slot))
+        throw std::runtime_error(name + " has an unexpected layout");
+    return shared;
+}
+
+SharedValues::SharedValues(const std::string &name, char *base, size_t size)
+    : _name(name),
+      _base(base),
+      _size(size),
+      _header(reinterpret_cast<Header *>(base)),
+      _slots(reinterpret_cast<Slot *>(base + sizeof(Header))) {
+}
+
+SharedValues::~SharedValues() {
+    munmap(_base, _size);
+}
+
+// Linear probing; returns the slot holding key, or the free slot where it
+// should be inserted, or NULL if all slots are taken.
+SharedValues::Slot *SharedValues::find(
+    const std::string &key,
+    uint64_t hash,
+    bool *found
+) const {
+    uint32_t mask = kSlots - 1;
+    uint32_t i = hash & mask;
+    for (uint32_t n = 0; n < kSlots; n++, i = (i + 1) & mask) {
+        Slot *slot = &_slots[i];
+        uint32_t key_size = slot->key_size.load(std::memory_order_acquire);
+        if (key_size == 0) {
+            *found = false;
+            return slot;
+        }
+        if (slot->hash == hash && key_size == key.size() &&
+                memcmp(slot->key, key.data(), key.size()) == 0) {
+            *found = true;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+bool SharedValues::store(
+    const std::string &key,
+    uint64_t hash,
+    string_ref value
+) {
+    if (key.empty() || key.size() > kMaxKey || value.size() > kMaxValue)
+        return false;
+    bool found;
+    Slot *slot = find(key, hash, &found);
+    if (!slot)
+        return false;
+    if (!found) {
+        slot->hash = hash;
+        memcpy(slot->key, key.data(), key.size());
+        slot->key_size.store(key.size(), std::memory_order_release);
+    }
+
+    uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t words[kMaxValue / sizeof(uint64_t)] = {};
+    memcpy(words, value.data(), value.size());
+    for (size_t i = 0; i * sizeof(uint64_t) < value.size(); i++)
+        slot->value[i].store(words[i], std::memory_order_relaxed);
+    slot->value_size.store(value.size(), std::memory_order_relaxed);
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+void SharedValues::publish() {
+    _header->generation.fetch_add(1, std::memory_order_release);
+    futex(&_header->generation, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void SharedValues::remove() {
+    _header->removed.store(1, std::memory_order_release);
+    publish();
+    if (shm_unlink(_name.c_str()) != 0 && errno != ENOENT)
+        throw std::runtime_error(errno_string("Cannot unlink", _name));
+}
+
+bool SharedValues::removed() const {
+    return _header->removed.load(std::memory_order_acquire) != 0;
+}
+
+uint32_t SharedValues::generation() const {
+    return _header->generation.load(std::memory_order_acquire);
+}
+
+void SharedValues::wait(
+    uint32_t seen,
+    std::chrono::milliseconds timeout
+) const {
+    struct timespec ts;
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+    // returns at once if the generation is not seen anymore
+    futex(&_header->generation, FUTEX_WAIT, seen, &ts);
+}
+
+void SharedValues::wake() const {
+    futex(&_header->generation, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+void SharedValues::changed(
+    std::vector<uint32_t> *seqs,
+    const std::function<bool(const std::string &key,
+        const std::string &value)> &fn
+) const {
+    seqs->resize(kSlots, 0);
+
+    std::string key, value;
+    uint64_t words[kMaxValue / sizeof(uint64_t)];
+    for (uint32_t i = 0; i < kSlots; i++) {
+        const Slot &slot = _slots[i];
+        uint32_t key_size = slot.key_size.load(std::memory_order_acquire);
+        if (key_size == 0 || key_size > kMaxKey)
+            continue;
+
+        uint32_t seq;
+        size_t value_size;
+        while (true) {
+            seq = slot.seq.load(std::memory_order_acquire);
+            if (seq == (*seqs)[i])
+                break;
+            if (seq & 1) {
+                sched_yield();  // being written
+                continue;
+            }
+            value_size = std::min<uint64_t>(
+                slot.value_size.load(std::memory_order_relaxed), kMaxValue);
+            for (size_t w = 0; w * sizeof(uint64_t) < value_size; w++)
+                words[w] = slot.value[w].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == seq)
+                break;
+        }
+        if (seq == (*seqs)[i])
+            continue;
+
+        key.assign(slot.key, key_size);
+        value.assign(reinterpret_cast<const char *>(words), value_size);
+        if (fn(key, value))
+            (*seqs)[i] = seq;
+    }
+}
+
+}  // namespace cpprestconfig
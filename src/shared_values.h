@@ -0,0 +1,86 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_SHARED_VALUES_H_
+#define SRC_SHARED_VALUES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/parse.h"
+
+namespace cpprestconfig {
+
+// Values shared with other processes through a POSIX shared memory segment
+// holding a fixed table of slots, indexed by key hash. A single process
+// writes; each slot is a seqlock, so that readers never block the writer
+// nor see a torn value. A 32-bit generation word is incremented after each
+// change, and readers wait for it with a futex.
+class SharedValues {
+ public:
+    static const uint32_t kSlots = 4096;  // a power of two
+    static const size_t kMaxKey = 120;
+    static const size_t kMaxValue = 256;
+
+    // Creates the segment, or reuses one of the same layout, for writing.
+    static std::unique_ptr<SharedValues> create(const std::string &name);
+
+    // Maps the segment read-only. Returns NULL if it is not created yet.
+    static std::unique_ptr<SharedValues> open(const std::string &name);
+
+    ~SharedValues();
+
+    // Returns false, without storing, if key or value is too long or if
+    // all slots are taken. Readers see the value after publish().
+    bool store(const std::string &key, uint64_t hash, string_ref value);
+
+    // Increments the generation and wakes up waiting readers.
+    void publish();
+
+    // Tells readers that no more changes will come, so that they open
+    // whichever segment is created next under the same name, then unlinks
+    // the segment. Otherwise, the next writer would reuse it, and new
+    // readers would see stale values until then. Throws
+    // std::runtime_error.
+    void remove();
+
+    bool removed() const;
+
+    uint32_t generation() const;
+
+    // Blocks until the generation differs from seen, wake() is called, or
+    // timeout passes.
+    void wait(uint32_t seen, std::chrono::milliseconds timeout) const;
+
+    // Wakes up all wait()ing threads, e.g., to stop them.
+    void wake() const;
+
+    // Calls fn(key, value) for each slot written since the sequence numbers
+    // left in seqs by the previous call. Slots for which fn returns false
+    // are passed again next time.
+    void changed(std::vector<uint32_t> *seqs,
+        const std::function<bool(const std::string &key,
+            const std::string &value)> &fn) const;
+
+ private:
+    struct Header;
+    struct Slot;
+
+    SharedValues(const std::string &name, char *base, size_t size);
+
+    Slot *find(const std::string &key, uint64_t hash, bool *found) const;
+
+    std::string _name;
+    char *_base;
+    size_t _size;
+    Header *_header;
+    Slot *_slots;
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_SHARED_VALUES_H_
@@ -0,0 +1,94 @@
+// Copyright 2019 Cristian Klein
+#include "src/snapshot.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace cpprestconfig {
+
+namespace {
+
+const char kSnapshotMagic[] = "CPRCSNAP";
+const size_t kSnapshotMagicSize = sizeof(kSnapshotMagic) - 1;
+
+void append_uint(std::string *buf, uint64_t v, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        buf->push_back(static_cast<char>(v >> (8 * i)));
+}
+
+void append_field(std::string *buf, string_ref s, size_t size_size,
+        const char *what) {
+    if (size_size < sizeof(uint64_t) && s.size() >> (8 * size_size))
+        throw std::length_error(std::string(what) + " too long to snapshot");
+    append_uint(buf, s.size(), size_size);
+    buf->append(s.data(), s.size());
+}
+
+}  // namespace
+
+const uint32_t SnapshotWriter::kVersion;
+
+SnapshotWriter::SnapshotWriter(
+    std::string *buf,
+    uint32_t count,
+    uint64_t generation
+) : _buf(buf) {
+    _buf->append(kSnapshotMagic, kSnapshotMagicSize);
+    append_uint(_buf, kVersion, 4);
+    append_uint(_buf, count, 4);
+    append_uint(_buf, generation, 8);
+}
+
+void SnapshotWriter::add(string_ref key, string_ref type, string_ref value) {
+    append_field(_buf, key, 2, "key");
+    append_field(_buf, type, 1, "type");
+    append_field(_buf, value, 4, "value");
+}
+
+SnapshotReader::SnapshotReader(const char *data, size_t size)
+    : _data(data), _end(data + size), _count(0), _left(0), _generation(0) {
+    if (size < kSnapshotMagicSize ||
+            memcmp(data, kSnapshotMagic, kSnapshotMagicSize) != 0)
+        throw parse_error("Not a snapshot");
+    _data += kSnapshotMagicSize;
+    uint32_t version = read_uint(4);
+    if (version != SnapshotWriter::kVersion) {
+        throw parse_error("Unsupported snapshot version " +
+            std::to_string(version));
+    }
+    _count = _left = read_uint(4);
+    _generation = read_uint(8);
+}
+
+string_ref SnapshotReader::read(size_t size) {
+    if (static_cast<size_t>(_end - _data) < size)
+        throw parse_error("Truncated snapshot");
+    string_ref s(_data, size);
+    _data += size;
+    return s;
+}
+
+uint64_t SnapshotReader::read_uint(size_t size) {
+    string_ref s = read(size);
+    uint64_t v = 0;
+    for (size_t i = 0; i < size; i++)
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(s.data()[i]))
+            << (8 * i);
+    return v;
+}
+
+bool SnapshotReader::next(string_ref *key, string_ref *type,
+        string_ref *value) {
+    if (_left == 0) {
+        if (_data != _end)
+            throw parse_error("Unexpected bytes after the snapshot");
+        return false;
+    }
+    *key = read(read_uint(2));
+    *type = read(read_uint(1));
+    *value = read(read_uint(4));
+    _left--;
+    return true;
+}
+
+}  // namespace cpprestconfig
@@ -0,0 +1,57 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_SNAPSHOT_H_
+#define SRC_SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "src/parse.h"
+
+namespace cpprestconfig {
+
+// A compact encoding of all values, to clone the configuration of one
+// server into another. Integers are little-endian:
+//   header: "CPRCSNAP", uint32 version, uint32 count, uint64 generation
+//   count times: uint16 key size, key, uint8 type size, type name,
+//                uint32 value size, value as persisted
+class SnapshotWriter {
+ public:
+    static const uint32_t kVersion = 1;
+
+    // Appends the header to buf, which must then get count values.
+    SnapshotWriter(std::string *buf, uint32_t count, uint64_t generation);
+
+    void add(string_ref key, string_ref type, string_ref value);
+
+ private:
+    std::string *_buf;
+};
+
+// Decodes a snapshot in place: keys, types and values refer to its bytes.
+class SnapshotReader {
+ public:
+    // Throws parse_error unless data starts with a header of a supported
+    // version.
+    SnapshotReader(const char *data, size_t size);
+
+    uint32_t count() const { return _count; }
+    uint64_t generation() const { return _generation; }
+
+    // Returns false after the last value. Throws parse_error if the
+    // snapshot is truncated or has bytes after its last value.
+    bool next(string_ref *key, string_ref *type, string_ref *value);
+
+ private:
+    string_ref read(size_t size);
+    uint64_t read_uint(size_t size);
+
+    const char *_data, *_end;
+    uint32_t _count, _left;
+    uint64_t _generation;
+};
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_SNAPSHOT_H_
@@ -0,0 +1,407 @@
+// Copyright 2019 Cristian Klein
+#include "src/unix_server.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "cpprest/containerstream.h"
+#include "cpprest/version.h"
+#include "src/logger.h"
+#include "src/parse.h"
+
+// http_request has no public way to be built as an http_listener builds
+// it: its body must be marked complete for extract_vector() and the like
+// to return, and relative_uri() needs the path listened on. Both are done
+// through members internal to cpprestsdk, used only in this file, and
+// unchanged across the versions below; check them again before allowing
+// another version.
+#if CPPRESTSDK_VERSION_MAJOR != 2 || CPPRESTSDK_VERSION_MINOR < 9 || \
+    CPPRESTSDK_VERSION_MINOR > 10
+#error "Check the http_request internals used by UnixServer"
+#endif
+
+namespace cpprestconfig {
+
+using web::http::http_request;
+using web::http::http_response;
+
+void set_listener_path(http_request *request, const std::string &path) {
+    request->_set_listener_path(path);
+}
+
+namespace {
+
+// See above.
+void set_body_complete(http_request *request, uint64_t size) {
+    request->_get_impl()->_complete(size);
+}
+
+std::string errno_string(const std::string &what, const std::string &path) {
+    return what + " " + path + ": " + strerror(errno);
+}
+
+bool send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Appends what is available to buf. Returns false on EOF or error.
+bool receive(int fd, std::string *buf) {
+    char chunk[4096];
+    while (true) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf->append(chunk, n);
+        return true;
+    }
+}
+
+// For requests that cannot be handed to the handler; closes the
+// connection afterwards, since the rest of the stream cannot be trusted.
+void reply_error(int fd, int code, const char *reason) {
+    std::string response = "HTTP/1.1 " + std::to_string(code) + " " +
+        reason + "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send_all(fd, response.data(), response.size());
+}
+
+bool iequals(const std::string &a, const char *b) {
+    return strcasecmp(a.c_str(), b) == 0;
+}
+
+std::string trim(const std::string &s, size_t begin, size_t end) {
+    while (begin < end && (s[begin] == ' ' || s[begin] == '\t'))
+        begin++;
+    while (end > begin && (s[end - 1] == ' ' || s[end - 1] == '\t'))
+        end--;
+    return s.substr(begin, end - begin);
+}
+
+}  // namespace
+
+const size_t UnixServer::kMaxHeaders;
+const size_t UnixServer::kMaxBody;
+const size_t UnixServer::kMaxConnections;
+
+UnixServer::UnixServer(const std::string &path, mode_t mode, Handler handler)
+    : _path(path),
+      _handler(handler),
+      _fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+      _stop_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      _reap_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      _stopping(false) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    std::string error;
+    struct stat st;
+    if (_fd < 0 || _stop_fd < 0 || _reap_fd < 0) {
+        error = errno_string("Cannot create socket for", path);
+    } else if (path.size() >= sizeof(addr.sun_path)) {
+        error = path + " is too long for a Unix domain socket";
+    } else if (lstat(path.c_str(), &st) == 0 && !S_ISSOCK(st.st_mode)) {
+        error = path + " exists and is not a socket";
+    } else {
+        unlink(path.c_str());  // left by a previous process
+        memcpy(addr.sun_path, path.data(), path.size());
+        // On Linux, the mode of the socket applies to the file it creates,
+        // so that it is never accessible to others, even briefly.
+        if (fchmod(_fd, mode) != 0 ||
+                bind(_fd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr)) != 0 ||
+                chmod(path.c_str(), mode) != 0 ||
+                listen(_fd, SOMAXCONN) != 0)
+            error = errno_string("Cannot listen on", path);
+    }
+    if (!error.empty()) {
+        if (_fd >= 0)
+            close(_fd);
+        if (_stop_fd >= 0)
+            close(_stop_fd);
+        if (_reap_fd >= 0)
+            close(_reap_fd);
+        throw std::runtime_error(error);
+    }
+    _thread = std::thread(&UnixServer::run, this);
+}
+
+UnixServer::~UnixServer() {
+    _stopping = true;
+    uint64_t one = 1;
+    if (write(_stop_fd, &one, sizeof(one)) != sizeof(one))
+        logger()->warn("Cannot stop serving {}", _path);
+    _thread.join();
+
+    std::list<Connection> connections;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (auto &connection : _connections)
+        shutdown(connection.fd, SHUT_RDWR);  // wakes up its thread
+    connections.swap(_connections);
+    lock.unlock();
+    for (auto &connection : connections) {
+        connection.thread.join();
+        close(connection.fd);
+    }
+
+    close(_fd);
+    close(_stop_fd);
+    close(_reap_fd);
+    unlink(_path.c_str());
+}
+
+void UnixServer::run() {
+    struct pollfd fds[3] = {
+        { _fd, POLLIN, 0 },
+        { _stop_fd, POLLIN, 0 },
+        { _reap_fd, POLLIN, 0 },
+    };
+    while (true) {
+        if (poll(fds, 3, -1) < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents)
+            break;
+        if (fds[2].revents)
+            reap();
+        if (!fds[0].revents)
+            continue;
+
+        int fd = accept4(_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;  // e.g., the client is gone already
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_connections.size() >= kMaxConnections) {
+            lock.unlock();
+            reply_error(fd, 503, "Service Unavailable");
+            close(fd);
+            continue;
+        }
+        _connections.push_back(Connection{fd, false, std::thread()});
+        Connection *connection = &_connections.back();
+        connection->thread = std::thread(&UnixServer::serve, this, connection);
+    }
+}
+
+// Joins the threads of connections that are done, so that neither they
+// nor their sockets linger until the next connection.
+void UnixServer::reap() {
+    uint64_t done;
+    if (read(_reap_fd, &done, sizeof(done)) != sizeof(done))
+        return;  // reaped already
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto it = _connections.begin(); it != _connections.end(); ) {
+        if (it->done) {
+            it->thread.join();
+            close(it->fd);
+            it = _connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void UnixServer::serve(Connection *connection) {
+    std::string buf;  // received, but not served yet
+    while (!_stopping && serve_one(connection->fd, &buf)) {
+    }
+    // closed when reaped, so that its number is not reused meanwhile
+    shutdown(connection->fd, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(_mutex);
+    connection->done = true;
+    uint64_t one = 1;
+    if (write(_reap_fd, &one, sizeof(one)) != sizeof(one))
+        logger()->warn("Cannot reap connection to {}", _path);
+}
+
+// Serves the next request of a connection. Returns false if the
+// connection should be closed.
+bool UnixServer::serve_one(int fd, std::string *buf) {
+    size_t end;
+    while ((end = buf->find("\r\n\r\n")) == std::string::npos) {
+        if (buf->size() > kMaxHeaders) {
+            reply_error(fd, 431, "Request Header Fields Too Large");
+            return false;
+        }
+        if (!receive(fd, buf))
+            return false;
+    }
+
+    // request line, e.g., "PUT /api/config/key HTTP/1.1"
+    size_t eol = buf->find("\r\n");
+    size_t sp1 = buf->find(' ');
+    size_t sp2 = sp1 < eol ? buf->find(' ', sp1 + 1) : std::string::npos;
+    if (sp2 >= eol || sp1 == 0 || sp2 == sp1 + 1) {
+        reply_error(fd, 400, "Bad Request");
+        return false;
+    }
+    std::string method = buf->substr(0, sp1);
+    std::string target = buf->substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string version = buf->substr(sp2 + 1, eol - sp2 - 1);
+    bool keep_alive = version == "HTTP/1.1";
+    if (!keep_alive && version != "HTTP/1.0") {
+        reply_error(fd, 505, "HTTP Version Not Supported");
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string>> headers;
+    uint64_t content_length = 0;
+    bool expect_continue = false;
+    for (size_t begin = eol + 2; begin < end + 2; begin = eol + 2) {
+        eol = buf->find("\r\n", begin);
+        size_t colon = buf->find(':', begin);
+        if (colon >= eol) {
+            reply_error(fd, 400, "Bad Request");
+            return false;
+        }
+        std::string name = buf->substr(begin, colon - begin);
+        std::string value = trim(*buf, colon + 1, eol);
+        if (iequals(name, "Content-Length")) {
+            try {
+                content_length = parse<uint64_t>(value);
+            } catch (const parse_error &) {
+                reply_error(fd, 400, "Bad Request");
+                return false;
+            }
+        } else if (iequals(name, "Transfer-Encoding")) {
+            reply_error(fd, 411, "Length Required");  // no chunked bodies
+            return false;
+        } else if (iequals(name, "Connection")) {
+            if (iequals(value, "close"))
+                keep_alive = false;
+            else if (iequals(value, "keep-alive"))
+                keep_alive = true;
+        } else if (iequals(name, "Expect")) {
+            expect_continue = iequals(value, "100-continue");
+        } else {
+            headers.push_back(std::make_pair(name, value));
+        }
+    }
+    if (content_length > kMaxBody) {
+        reply_error(fd, 413, "Payload Too Large");
+        return false;
+    }
+
+    size_t body_begin = end + 4;
+    if (expect_continue && buf->size() < body_begin + content_length) {
+        const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!send_all(fd, kContinue, sizeof(kContinue) - 1))
+            return false;
+    }
+    while (buf->size() < body_begin + content_length) {
+        if (!receive(fd, buf))
+            return false;
+    }
+    std::vector<unsigned char> body(buf->begin() + body_begin,
+        buf->begin() + body_begin + content_length);
+    buf->erase(0, body_begin + content_length);
+
+    http_request request(method);
+    try {
+        request.set_request_uri(web::uri(target));
+    } catch (const std::exception &) {
+        reply_error(fd, 400, "Bad Request");
+        return false;
+    }
+    request.set_body(std::move(body));
+    for (auto const &h : headers) {
+        if (iequals(h.first, "Content-Type"))
+            request.headers().set_content_type(h.second);
+        else
+            request.headers().add(h.first, h.second);
+    }
+    set_body_complete(&request, content_length);
+
+    // Bridges to a future, so that waiting can be interrupted, e.g., for
+    // a watch waiting for changes.
+    auto replied = std::make_shared<std::promise<http_response>>();
+    auto response_future = replied->get_future();
+    request.get_response().then(
+        [replied](pplx::task<http_response> response) {
+            try {
+                replied->set_value(response.get());
+            } catch (...) {
+                replied->set_exception(std::current_exception());
+            }
+        });
+    try {
+        _handler(request);
+    } catch (const std::exception &ex) {
+        logger()->warn("Exception {}", ex.what());
+        try {
+            request.reply(web::http::status_codes::InternalError);
+        } catch (const std::exception &) {
+            // replied already
+        }
+    }
+    while (response_future.wait_for(std::chrono::milliseconds(100)) !=
+            std::future_status::ready) {
+        if (_stopping)
+            return false;
+    }
+
+    http_response response;
+    std::vector<unsigned char> response_body;
+    try {
+        response = response_future.get();
+        auto stream = response.body();
+        if (stream.is_valid()) {
+            concurrency::streams::container_buffer<
+                std::vector<unsigned char>> collected;
+            stream.read_to_end(collected).get();
+            response_body = collected.collection();
+        }
+    } catch (const std::exception &ex) {
+        logger()->warn("Exception {}", ex.what());
+        reply_error(fd, 500, "Internal Server Error");
+        return false;
+    }
+
+    std::string head = "HTTP/1.1 " + std::to_string(response.status_code()) +
+        " " + response.reason_phrase() + "\r\n";
+    for (auto const &h : response.headers()) {
+        if (iequals(h.first, "Content-Length") ||
+                iequals(h.first, "Transfer-Encoding") ||
+                iequals(h.first, "Connection"))
+            continue;
+        head += h.first + ": " + h.second + "\r\n";
+    }
+    head += "Content-Length: " + std::to_string(response_body.size()) +
+        "\r\n";
+    if (!keep_alive)
+        head += "Connection: close\r\n";
+    head += "\r\n";
+    if (!send_all(fd, head.data(), head.size()) ||
+            !send_all(fd, reinterpret_cast<const char *>(response_body.data()),
+                response_body.size()))
+        return false;
+    return keep_alive;
+}
+
+}  // namespace cpprestconfig
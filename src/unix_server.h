@@ -0,0 +1,71 @@
+// Copyright 2019 Cristian Klein
+#ifndef SRC_UNIX_SERVER_H_
+#define SRC_UNIX_SERVER_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "cpprest/http_msg.h"
+
+namespace cpprestconfig {
+
+// Serves HTTP/1.1 on a Unix domain socket, so that local tools need
+// neither a TCP port nor a loopback connection, and file permissions
+// control who may connect. Each request is handed to handler as an
+// http_request, the same as from an http_listener, and the response it
+// replies with is written back. Requests of a connection are served in
+// order, from a thread per connection, and at most kMaxConnections are
+// served at once; others get 503. Bodies need a Content-Length.
+class UnixServer {
+ public:
+    typedef std::function<void(web::http::http_request)> Handler;
+
+    static const size_t kMaxHeaders = 64 * 1024;
+    static const size_t kMaxBody = 64 * 1024 * 1024;
+    static const size_t kMaxConnections = 64;
+
+    // Listens on path with the given mode, replacing a socket left there
+    // by a previous process. Throws std::runtime_error.
+    UnixServer(const std::string &path, mode_t mode, Handler handler);
+
+    // Closes all connections, without waiting for pending responses, and
+    // removes path.
+    ~UnixServer();
+
+ private:
+    struct Connection {
+        int fd;
+        bool done;  // under _mutex
+        std::thread thread;
+    };
+
+    void run();
+    void reap();
+    void serve(Connection *connection);
+    bool serve_one(int fd, std::string *buf);
+
+    std::string _path;
+    Handler _handler;
+    int _fd, _stop_fd;
+    int _reap_fd;  // signaled by connections when done
+    std::atomic<bool> _stopping;
+
+    std::mutex _mutex;
+    std::list<Connection> _connections;
+    std::thread _thread;  // last, starts using the above
+};
+
+// Sets the path that the relative_uri() of request is relative to, as an
+// http_listener listening on path would.
+void set_listener_path(web::http::http_request *request,
+    const std::string &path);
+
+}  // namespace cpprestconfig
+
+#endif  // SRC_UNIX_SERVER_H_